@@ -0,0 +1,197 @@
+// 
+// 
+// 
+
+#include "FanCoilBrokers.h"
+#include "KMPCommon.h"
+
+/**
+* @brief Fill the broker list from settings.
+* @param settings MqttServer, MqttPort and MqttFallbackServers: "host:port;host:port".
+*
+* @return void
+**/
+void FanCoilBrokersClass::init(DeviceSettings* settings)
+{
+	_count = 0;
+	_current = 0;
+
+	add(settings->MqttServer, strlen(settings->MqttServer), atoi(settings->MqttPort));
+
+	const char* item = settings->MqttFallbackServers;
+	while (*item != CH_NONE && _count < MQTT_BROKERS_MAX)
+	{
+		const char* itemEnd = strchr(item, PAYLOAD_SEPARATOR);
+		size_t itemLen = itemEnd == NULL ? strlen(item) : itemEnd - item;
+
+		// Port is after the last ':' in the item.
+		const char* portStr = NULL;
+		for (size_t i = 0; i < itemLen; i++)
+		{
+			if (item[i] == ':')
+			{
+				portStr = item + i;
+			}
+		}
+
+		if (portStr != NULL)
+		{
+			add(item, portStr - item, atoi(portStr + 1));
+		}
+
+		item += itemLen;
+		if (*item != CH_NONE)
+		{
+			item++;
+		}
+	}
+}
+
+void FanCoilBrokersClass::add(const char* host, size_t hostLen, uint16_t port)
+{
+	if (hostLen == 0 || hostLen >= MQTT_SERVER_LEN || port == 0)
+	{
+		return;
+	}
+
+	MqttBroker* broker = &_brokers[_count++];
+	memcpy(broker->Host, host, hostLen);
+	broker->Host[hostLen] = CH_NONE;
+	broker->Port = port;
+	broker->Failures = 0;
+	broker->Health = MQTT_BROKER_MAX_HEALTH;
+	broker->ConnectMs = 0;
+	broker->RetryTime = 0;
+	broker->Mfln = -1;
+}
+
+bool FanCoilBrokersClass::isAvailable(MqttBroker* broker)
+{
+	return broker->Failures < MQTT_BROKER_MAX_FAILURES || timeToDeadline(broker->RetryTime) < 0;
+}
+
+/**
+* @brief Broker cost. Lower is better. It is the connect latency and a penalty for failures in the past.
+**/
+uint32_t FanCoilBrokersClass::cost(MqttBroker* broker)
+{
+	uint32_t latency = broker->ConnectMs == 0 ? MQTT_BROKER_UNKNOWN_LATENCY_MS : broker->ConnectMs;
+
+	return latency + (MQTT_BROKER_MAX_HEALTH - broker->Health) * MQTT_BROKER_HEALTH_PENALTY_MS;
+}
+
+/**
+* @brief Select a broker for the next connect. The current broker is kept until it fails MQTT_BROKER_MAX_FAILURES times.
+*
+* @return MqttBroker* The broker to connect, or NULL if there are no brokers.
+**/
+MqttBroker* FanCoilBrokersClass::select()
+{
+	if (_count == 0)
+	{
+		return NULL;
+	}
+
+	if (_disconnectTime == 0)
+	{
+		_disconnectTime = millis();
+	}
+
+	if (_brokers[_current].Failures > 0 && _brokers[_current].Failures < MQTT_BROKER_MAX_FAILURES)
+	{
+		return &_brokers[_current];
+	}
+
+	// The fastest healthy broker. If all are failed, the one with the earliest retry time.
+	int8_t best = -1;
+	for (uint8_t i = 0; i < _count; i++)
+	{
+		MqttBroker* broker = &_brokers[i];
+		if (!isAvailable(broker))
+		{
+			continue;
+		}
+
+		if (best < 0 || cost(broker) < cost(&_brokers[best]))
+		{
+			best = i;
+		}
+	}
+
+	if (best < 0)
+	{
+		best = 0;
+		for (uint8_t i = 1; i < _count; i++)
+		{
+			if (timeToDeadline(_brokers[i].RetryTime) < timeToDeadline(_brokers[best].RetryTime))
+			{
+				best = i;
+			}
+		}
+	}
+
+	_current = best;
+
+	return &_brokers[_current];
+}
+
+MqttBroker* FanCoilBrokersClass::current()
+{
+	return &_brokers[_current];
+}
+
+/**
+* @brief The current broker is connected.
+* @param connectMs Connect latency.
+*
+* @return void
+**/
+void FanCoilBrokersClass::connected(uint32_t connectMs)
+{
+	MqttBroker* broker = current();
+
+	broker->Failures = 0;
+	// Rounded up, so the health reaches the maximum and does not stall a few points below it.
+	broker->Health += (MQTT_BROKER_MAX_HEALTH - broker->Health + 3) / 4;
+	broker->ConnectMs = broker->ConnectMs == 0 ? connectMs : (broker->ConnectMs * 3 + connectMs + 2) / 4;
+
+	DEBUG_FC_PRINT(F("Broker "));
+	DEBUG_FC_PRINT(broker->Host);
+	DEBUG_FC_PRINT(F(" is used. Connecting time since disconnect: "));
+	DEBUG_FC_PRINT(millis() - _disconnectTime);
+	DEBUG_FC_PRINTLN(F(" ms"));
+
+	_disconnectTime = 0;
+}
+
+/**
+* @brief Connect to the current broker is failed.
+*
+* @return bool true - the broker is marked as failed and other broker should be tried immediately.
+**/
+bool FanCoilBrokersClass::failed()
+{
+	MqttBroker* broker = current();
+
+	broker->Health -= (broker->Health + 3) / 4;
+
+	if (++broker->Failures < MQTT_BROKER_MAX_FAILURES)
+	{
+		return false;
+	}
+
+	broker->RetryTime = millis() + MQTT_BROKER_RETRY_MS;
+
+	// Switch immediately if there is other available broker.
+	for (uint8_t i = 0; i < _count; i++)
+	{
+		if (i != _current && isAvailable(&_brokers[i]))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+FanCoilBrokersClass FanCoilBrokers;
@@ -0,0 +1,63 @@
+// FanCoilBrokers.h
+
+#ifndef _FANCOILBROKERS_h
+#define _FANCOILBROKERS_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+
+// Main MQTT server and fallback servers.
+#define MQTT_BROKERS_MAX 4
+// After these consecutive connect failures the device switches to the next broker.
+#define MQTT_BROKER_MAX_FAILURES 2
+// A failed broker is skipped for this time.
+#define MQTT_BROKER_RETRY_MS 300000
+// Each missing health point costs as this connect latency in ms.
+#define MQTT_BROKER_HEALTH_PENALTY_MS 50
+// Connect latency for a broker which has not been connected yet.
+#define MQTT_BROKER_UNKNOWN_LATENCY_MS 1000
+#define MQTT_BROKER_MAX_HEALTH 100
+
+struct MqttBroker
+{
+	char Host[MQTT_SERVER_LEN];
+	uint16_t Port;
+	// Consecutive connect failures
+	uint8_t Failures;
+	// Success rate 0..100 (MQTT_BROKER_MAX_HEALTH). Every connect moves it by 1/4 to 0 or 100.
+	uint8_t Health;
+	// Smoothed connect latency in ms. 0 - not measured.
+	uint32_t ConnectMs;
+	// Time after the broker can be used again, if it has failed
+	unsigned long RetryTime;
+	// TLS Maximum Fragment Length Negotiation support: -1 - unknown, 0 - not supported, 1 - supported
+	int8_t Mfln;
+};
+
+/**
+* @brief Ordered list of MQTT brokers: MqttServer:MqttPort first, then MqttFallbackServers.
+* The device fails over after MQTT_BROKER_MAX_FAILURES and prefers the fastest healthy broker.
+**/
+class FanCoilBrokersClass
+{
+private:
+	MqttBroker _brokers[MQTT_BROKERS_MAX];
+	uint8_t _count = 0;
+	uint8_t _current = 0;
+	unsigned long _disconnectTime = 0;
+
+	void add(const char* host, size_t hostLen, uint16_t port);
+	bool isAvailable(MqttBroker* broker);
+	uint32_t cost(MqttBroker* broker);
+public:
+	void init(DeviceSettings* settings);
+
+	MqttBroker* select();
+	MqttBroker* current();
+	void connected(uint32_t connectMs);
+	bool failed();
+};
+
+extern FanCoilBrokersClass FanCoilBrokers;
+
+#endif
@@ -22,6 +22,33 @@ DeviceState FanCoilBypassClass::state()
 	return _bypassState;
 }
 
+/**
+* @brief The state which the bypass has or is changing to.
+*
+* @return DeviceState
+*/
+DeviceState FanCoilBypassClass::targetState()
+{
+	return _bypassStateIsChanging ? _bypassNewState : _bypassState;
+}
+
+/**
+* @brief Restore the bypass state after a warm restart without moving the valve.
+* @param state The bypass state before the restart.
+* @param target The state which was being set before the restart. If it differs, the change is started again.
+*
+* @return void
+**/
+void FanCoilBypassClass::restoreState(DeviceState state, DeviceState target)
+{
+	_bypassState = state;
+
+	if (target != state)
+	{
+		setBypassState(target, true);
+	}
+}
+
 void FanCoilBypassClass::setBypassPin(DeviceState state, bool isEnable)
 {
 	if (state == On)
@@ -26,8 +26,10 @@ public:
 	void init(callBackPublishData publishData);
 
 	DeviceState state();
+	DeviceState targetState();
 
 	void setBypassState(DeviceState state, bool forceState = false);
+	void restoreState(DeviceState state, DeviceState target);
 	void processByPassState();
 };
 
@@ -2,6 +2,100 @@
 #include "KMPCommon.h"
 #include <ArduinoJson.h>          // Install with Library Manager. "ArduinoJson by Benoit Blanchon" https://github.com/bblanchon/ArduinoJson
 
+const char MQTT_SERVER_KEY[] PROGMEM = "mqttServer";
+const char MQTT_PORT_KEY[] PROGMEM = "mqttPort";
+const char MQTT_FALLBACK_SERVERS_KEY[] PROGMEM = "mqttFallbackServers";
+const char REMOTE_SENSORS_KEY[] PROGMEM = "remoteSensors";
+const char REMOTE_SENSOR_LOCAL[] PROGMEM = "local";
+const char OUTDOOR_TOPIC_KEY[] PROGMEM = "outdoorTopic";
+const char HEAT_CURVE_KEY[] PROGMEM = "heatCurve";
+const char COLD_CURVE_KEY[] PROGMEM = "coldCurve";
+const char MQTT_CLIENT_ID_KEY[] PROGMEM = "mqttClientId";
+const char MQTT_USER_KEY[] PROGMEM = "mqttUser";
+const char MQTT_PASS_KEY[] PROGMEM = "mqttPass";
+const char MQTT_FINGERPRINT_KEY[] PROGMEM = "mqttFingerprint";
+const char BASE_TOPIC_KEY[] PROGMEM = "baseTopic";
+const char MODE_KEY[] PROGMEM = "mode";
+const char DEVICE_STATE_KEY[] PROGMEM = "state";
+const char DESIRED_TEMPERATURE_KEY[] PROGMEM = "desiredTemp";
+const char MAX_HUMIDITY_KEY[] PROGMEM = "maxHumidity";
+const char CONFIG_FILE_NAME[] PROGMEM = "/config.json";
+
+const char TOPIC_HUMIDITY[] PROGMEM = "humidity";
+const char TOPIC_DESIRED_TEMPERATURE[] PROGMEM = "desiredtemp";
+const char TOPIC_BYPASS_STATE[] PROGMEM = "bypassstate";
+const char TOPIC_WINDOW_OPEN[] PROGMEM = "windowopen";
+const char TOPIC_HUMIDITY_LIMIT[] PROGMEM = "humiditylimit";
+const char TOPIC_DEW_POINT[] PROGMEM = "dewpoint";
+const char TOPIC_TEMPERATURE[] PROGMEM = "temperature";
+const char TOPIC_SET[] PROGMEM = "set";
+const char TOPIC_GET[] PROGMEM = "get";
+const char TOPIC_MODE[] PROGMEM = "mode";
+const char TOPIC_DEVICE_STATE[] PROGMEM = "state";
+const char TOPIC_FAN_DEGREE[] PROGMEM = "fandegree";
+const char TOPIC_INLET_TEMPERATURE[] PROGMEM = "inlettemp";
+const char TOPIC_STATUS[] PROGMEM = "status";
+const char TOPIC_AVAILABILITY[] PROGMEM = "availability";
+const char TOPIC_ACK[] PROGMEM = "ack";
+const char TOPIC_PING[] PROGMEM = "ping";
+const char TOPIC_PONG[] PROGMEM = "pong";
+const char PAYLOAD_HEAT[] PROGMEM = "heat";
+const char PAYLOAD_COLD[] PROGMEM = "cold";
+const char PAYLOAD_ON[] PROGMEM = "on";
+const char PAYLOAD_OFF[] PROGMEM = "off";
+const char PAYLOAD_ONLINE[] PROGMEM = "online";
+const char PAYLOAD_OFFLINE[] PROGMEM = "offline";
+const char PAYLOAD_OK[] PROGMEM = "ok";
+const char PAYLOAD_ERROR[] PROGMEM = "error";
+const char PAYLOAD_COALESCED[] PROGMEM = "coalesced";
+const char PAYLOAD_COMMAND_ID[] PROGMEM = "id";
+
+const char TOPIC_OTA[] PROGMEM = "ota";
+const char TOPIC_OTA_BEGIN[] PROGMEM = "begin";
+const char TOPIC_OTA_CHUNK[] PROGMEM = "chunk";
+const char TOPIC_OTA_END[] PROGMEM = "end";
+const char TOPIC_OTA_ABORT[] PROGMEM = "abort";
+const char TOPIC_OTA_STATE[] PROGMEM = "otastate";
+const char PAYLOAD_OTA_RECEIVING[] PROGMEM = "receiving";
+const char PAYLOAD_OTA_DONE[] PROGMEM = "done";
+
+const char HTTP_STATUS_PATH[] PROGMEM = "/status";
+const char HTTP_METRICS_PATH[] PROGMEM = "/metrics";
+const char CONTENT_TYPE_JSON[] PROGMEM = "application/json";
+const char CONTENT_TYPE_TEXT[] PROGMEM = "text/plain; version=0.0.4";
+const char TOPIC_METRICS[] PROGMEM = "metrics";
+const char METRICS_PREFIX[] PROGMEM = "thermostat_";
+const char METRIC_LIMITED_SET[] PROGMEM = "limited_set";
+const char METRIC_LIMITED_GET[] PROGMEM = "limited_get";
+const char METRIC_LIMITED_PING[] PROGMEM = "limited_ping";
+// Duration of the last temperature and humidity sensor read in us
+const char METRIC_SENSOR_READ[] PROGMEM = "sensor_read_us";
+const char METRIC_SENSOR_READS[] PROGMEM = "sensor_reads";
+const char METRIC_ENERGY[] PROGMEM = "energy_mwh_per_hour";
+const char METRIC_SLEEP[] PROGMEM = "sleep_percent";
+const char METRIC_HEAT[] PROGMEM = "heat_wh";
+const char METRIC_COOL[] PROGMEM = "cool_wh";
+const char METRIC_BYPASS_ON[] PROGMEM = "bypass_on_seconds";
+const char METRIC_ROOM_TEMPERATURE[] PROGMEM = "room_temperature";
+const char METRIC_OUTDOOR_TEMPERATURE[] PROGMEM = "outdoor_temperature";
+const char METRIC_DESIRED_OFFSET[] PROGMEM = "desired_offset";
+
+const char TOPIC_RUNTIME[] PROGMEM = "runtime";
+const char RUNTIME_FILE_NAME[] PROGMEM = "/runtime.json";
+const char RUNTIME_FAN_DEGREE_KEY[] PROGMEM = "fanDegreeSeconds";
+const char RUNTIME_BYPASS_ON_KEY[] PROGMEM = "bypassOnSeconds";
+const char RUNTIME_HEAT_WH_KEY[] PROGMEM = "heatWh";
+const char RUNTIME_COOL_WH_KEY[] PROGMEM = "coolWh";
+const char RUNTIME_HEAT_J_KEY[] PROGMEM = "heatJ";
+const char RUNTIME_COOL_J_KEY[] PROGMEM = "coolJ";
+
+const char EVERY_ONE_LEVEL_TOPIC[] PROGMEM = "+";
+const char EVERY_MULTI_LEVEL_TOPIC[] PROGMEM = "#";
+const char NOT_AVILABLE[] PROGMEM = "N/A";
+
+const char MUST_BE_ONE[] PROGMEM = "Must be one";
+const char NOT_A_NUMBER[] PROGMEM = "nan";
+
 SensorData TemperatureData;
 float TempCollection[TEMPERATURE_ARRAY_LEN];
 
@@ -56,6 +150,158 @@ float calcAverage(float * data, uint8 dataLength, uint8 precision)
 	return result;
 }
 
+/**
+* @brief Time from now to a millis() deadline. The difference of unsigned times is right over millis() rollover,
+* comparing the deadline with millis() directly is not.
+* @param deadline The deadline, millis() + interval.
+*
+* @return long Time in ms, negative - the deadline is passed.
+*/
+long timeToDeadline(unsigned long deadline)
+{
+	return (long)(deadline - millis());
+}
+
+/**
+* @brief Is a sensor read needed for the channel. Reads are done only before the next averaging tick:
+* one read, or SENSOR_OVERSAMPLING reads every SENSOR_OVERSAMPLING_INTERVAL_MS ending at the tick.
+* @param data The channel.
+*
+* @return bool true - read the sensor now.
+*/
+bool isSampleDue(SensorData* data)
+{
+	if (timeToDeadline(data->CheckInterval) > (long)((SENSOR_OVERSAMPLING - 1) * SENSOR_OVERSAMPLING_INTERVAL_MS))
+	{
+		return false;
+	}
+
+	return data->SampleCount == 0
+		|| (data->SampleCount < SENSOR_OVERSAMPLING && millis() - data->SampleTime >= SENSOR_OVERSAMPLING_INTERVAL_MS);
+}
+
+/**
+* @brief Time until the channel needs a read or its tick.
+* @param data The channel.
+*
+* @return unsigned long Time in ms, 0 - now.
+*/
+unsigned long timeToSample(SensorData* data)
+{
+	long remaining = timeToDeadline(data->CheckInterval);
+	if (isSampleDue(data) || remaining < 0)
+	{
+		return 0;
+	}
+
+	long burst = (SENSOR_OVERSAMPLING - 1) * SENSOR_OVERSAMPLING_INTERVAL_MS;
+	if (remaining > burst)
+	{
+		return remaining - burst;
+	}
+
+	// Inside the oversampling burst: the next read or the tick.
+	unsigned long result = remaining + 1;
+	unsigned long nextRead = SENSOR_OVERSAMPLING_INTERVAL_MS - (millis() - data->SampleTime);
+	if (data->SampleCount < SENSOR_OVERSAMPLING && nextRead < result)
+	{
+		result = nextRead;
+	}
+
+	return result;
+}
+
+/**
+* @brief Add a read to the channel. Current is the average of the reads since the last tick.
+* @param data The channel.
+* @param value Measured value.
+*
+* @return void
+*/
+void addSample(SensorData* data, float value)
+{
+	data->SampleSum += value;
+	data->SampleCount++;
+	data->SampleTime = millis();
+	data->Current = data->SampleSum / data->SampleCount;
+}
+
+void resetSamples(SensorData* data)
+{
+	data->SampleSum = 0;
+	data->SampleCount = 0;
+}
+
+/**
+* @brief Adapt the channel sample interval after a tick. The averaging window (DataCollectionLen samples) should not be
+* longer than the estimated time until the average reaches the nearest decision: distance to it / trend.
+* The interval is from CheckDataIntervalMS to ADAPTIVE_MAX_INTERVAL_FACTOR times it.
+* @param data The channel.
+*
+* @return void
+*/
+void updateSampleInterval(SensorData* data)
+{
+	unsigned long now = millis();
+
+	// The slope is taken only from a tick with own samples. A tick without them keeps an older Current value.
+	if (data->IsExists && data->SampleCount > 0)
+	{
+		if (data->SlopeTime != 0 && now != data->SlopeTime)
+		{
+			float slope = (data->Current - data->SlopeValue) * 3600000.0 / (now - data->SlopeTime);
+			data->Slope += ADAPTIVE_SLOPE_WEIGHT * (slope - data->Slope);
+		}
+
+		data->SlopeValue = data->Current;
+		data->SlopeTime = now;
+	}
+
+	float margin = data->Margin == NULL ? NAN : data->Margin(data->Average);
+	if (std::isnan(margin))
+	{
+		margin = ADAPTIVE_FREE_MARGIN;
+	}
+
+	float slope = fabs(data->Slope);
+	if (slope < ADAPTIVE_MIN_SLOPE)
+	{
+		slope = ADAPTIVE_MIN_SLOPE;
+	}
+
+	float interval = margin / slope * 3600000.0 / data->DataCollectionLen;
+	uint maxInterval = data->CheckDataIntervalMS * ADAPTIVE_MAX_INTERVAL_FACTOR;
+
+	if (interval < data->CheckDataIntervalMS)
+	{
+		data->SampleIntervalMS = data->CheckDataIntervalMS;
+	}
+	else if (interval > maxInterval)
+	{
+		data->SampleIntervalMS = maxInterval;
+	}
+	else
+	{
+		data->SampleIntervalMS = interval;
+	}
+}
+
+/**
+* @brief Sample the channel at the base rate. Used when a decision threshold is moved (desired temperature, mode or state).
+* @param data The channel.
+*
+* @return void
+*/
+void resetSampleInterval(SensorData* data)
+{
+	data->SampleIntervalMS = data->CheckDataIntervalMS;
+
+	if (timeToDeadline(data->CheckInterval) > (long)data->CheckDataIntervalMS)
+	{
+		data->CheckInterval = millis() + data->CheckDataIntervalMS;
+	}
+}
+
 /**
 * @brief Print debug information about topic and payload.
 * @operationName Operation which send this data.
@@ -106,14 +352,14 @@ void ReadConfiguration(DeviceSettings* settings)
 
 	DEBUG_FC_PRINTLN("The file system is mounted.");
 
-	if (!SPIFFS.exists(CONFIG_FILE_NAME))
+	if (!SPIFFS.exists(FPSTR(CONFIG_FILE_NAME)))
 	{
 		return;
 	}
 
 	// File exists
 	DEBUG_FC_PRINTLN("Reading configuration file");
-	File configFile = SPIFFS.open(CONFIG_FILE_NAME, "r");
+	File configFile = SPIFFS.open(FPSTR(CONFIG_FILE_NAME), "r");
 	if (!configFile)
 	{
 		DEBUG_FC_PRINTLN("Warning: can not open the configuration file");
@@ -142,17 +388,27 @@ void ReadConfiguration(DeviceSettings* settings)
 #endif
 	DEBUG_FC_PRINTLN("\nJson is parsed");
 
-	copyJsonValue(settings->MqttServer, jsonDoc[MQTT_SERVER_KEY]);
-	copyJsonValue(settings->MqttPort, jsonDoc[MQTT_PORT_KEY]);
-	copyJsonValue(settings->MqttClientId, jsonDoc[MQTT_CLIENT_ID_KEY]);
-	copyJsonValue(settings->MqttUser, jsonDoc[MQTT_USER_KEY]);
-	copyJsonValue(settings->MqttPass, jsonDoc[MQTT_PASS_KEY]);
-	copyJsonValue(settings->BaseTopic, jsonDoc[BASE_TOPIC_KEY]);
+	copyJsonValue(settings->MqttServer, jsonDoc[FPSTR(MQTT_SERVER_KEY)]);
+	copyJsonValue(settings->MqttPort, jsonDoc[FPSTR(MQTT_PORT_KEY)]);
+	copyJsonValue(settings->MqttFallbackServers, jsonDoc[FPSTR(MQTT_FALLBACK_SERVERS_KEY)]);
+	copyJsonValue(settings->MqttClientId, jsonDoc[FPSTR(MQTT_CLIENT_ID_KEY)]);
+	copyJsonValue(settings->MqttUser, jsonDoc[FPSTR(MQTT_USER_KEY)]);
+	copyJsonValue(settings->MqttPass, jsonDoc[FPSTR(MQTT_PASS_KEY)]);
+	copyJsonValue(settings->MqttFingerprint, jsonDoc[FPSTR(MQTT_FINGERPRINT_KEY)]);
+	copyJsonValue(settings->BaseTopic, jsonDoc[FPSTR(BASE_TOPIC_KEY)]);
+	copyJsonValue(settings->RemoteSensors, jsonDoc[FPSTR(REMOTE_SENSORS_KEY)]);
+	copyJsonValue(settings->OutdoorTopic, jsonDoc[FPSTR(OUTDOOR_TOPIC_KEY)]);
+	copyJsonValue(settings->HeatCurve, jsonDoc[FPSTR(HEAT_CURVE_KEY)]);
+	copyJsonValue(settings->ColdCurve, jsonDoc[FPSTR(COLD_CURVE_KEY)]);
 
 	// After start the device we can set this settings.
-	copyJsonValue(settings->Mode, jsonDoc[MODE_KEY]);
-	copyJsonValue(settings->DeviceState, jsonDoc[DEVICE_STATE_KEY]);
-	copyJsonValue(settings->DesiredTemperature, jsonDoc[DESIRED_TEMPERATURE_KEY]);
+	for (uint8_t i = 0; i < DATA_FIELDS_LEN; i++)
+	{
+		if (DATA_FIELDS[i].SettingsKey != NULL)
+		{
+			copyJsonValue((char*)settings + DATA_FIELDS[i].SettingsOffset, jsonDoc[FPSTR(DATA_FIELDS[i].SettingsKey)]);
+		}
+	}
 
 	jsonDoc.~BasicJsonDocument();
 	buf.~unique_ptr();
@@ -176,18 +432,34 @@ bool mangeConnectAndSettings(WiFiManager* wifiManager, DeviceSettings* settings,
 	// id/name placeholder/prompt default length
 	WiFiManagerParameter customMqttServer("server", "MQTT server", settings->MqttServer, MQTT_SERVER_LEN);
 	WiFiManagerParameter customMqttPort("port", "MQTT port", settings->MqttPort, MQTT_PORT_LEN);
+	WiFiManagerParameter customMqttFallbackServers("fallbackServers", "MQTT fallback servers host:port;host:port", settings->MqttFallbackServers, MQTT_FALLBACK_SERVERS_LEN);
 	WiFiManagerParameter customClientName("clientName", "Client name", settings->MqttClientId, MQTT_CLIENT_ID_LEN);
 	WiFiManagerParameter customMqttUser("user", "MQTT user", settings->MqttUser, MQTT_USER_LEN);
 	WiFiManagerParameter customMqttPass("password", "MQTT pass", settings->MqttPass, MQTT_PASS_LEN);
+#ifdef MQTT_USE_TLS
+	WiFiManagerParameter customMqttFingerprint("fingerprint", "MQTT certificate SHA1", settings->MqttFingerprint, MQTT_FINGERPRINT_LEN);
+#endif
 	WiFiManagerParameter customBaseTopic("baseTopic", "Main topic", settings->BaseTopic, BASE_TOPIC_LEN);
+	WiFiManagerParameter customRemoteSensors("remoteSensors", "Room temperature topics topic=weight;topic=weight", settings->RemoteSensors, REMOTE_SENSORS_LEN);
+	WiFiManagerParameter customOutdoorTopic("outdoorTopic", "Outdoor temperature topic", settings->OutdoorTopic, OUTDOOR_TOPIC_LEN);
+	WiFiManagerParameter customHeatCurve("heatCurve", "Heat curve outdoor=offset;outdoor=offset", settings->HeatCurve, WEATHER_CURVE_SETTING_LEN);
+	WiFiManagerParameter customColdCurve("coldCurve", "Cold curve outdoor=offset;outdoor=offset", settings->ColdCurve, WEATHER_CURVE_SETTING_LEN);
 
 	// add all your parameters here
 	wifiManager->addParameter(&customMqttServer);
 	wifiManager->addParameter(&customMqttPort);
+	wifiManager->addParameter(&customMqttFallbackServers);
 	wifiManager->addParameter(&customClientName);
 	wifiManager->addParameter(&customMqttUser);
 	wifiManager->addParameter(&customMqttPass);
+#ifdef MQTT_USE_TLS
+	wifiManager->addParameter(&customMqttFingerprint);
+#endif
 	wifiManager->addParameter(&customBaseTopic);
+	wifiManager->addParameter(&customRemoteSensors);
+	wifiManager->addParameter(&customOutdoorTopic);
+	wifiManager->addParameter(&customHeatCurve);
+	wifiManager->addParameter(&customColdCurve);
 
 	DEBUG_FC_PRINTLN(F("Waiting WiFi up..."));
 
@@ -212,10 +484,18 @@ bool mangeConnectAndSettings(WiFiManager* wifiManager, DeviceSettings* settings,
 		//read updated parameters
 		strcpy(settings->MqttServer, customMqttServer.getValue());
 		strcpy(settings->MqttPort, customMqttPort.getValue());
+		strcpy(settings->MqttFallbackServers, customMqttFallbackServers.getValue());
 		strcpy(settings->MqttClientId, customClientName.getValue());
 		strcpy(settings->MqttUser, customMqttUser.getValue());
 		strcpy(settings->MqttPass, customMqttPass.getValue());
+#ifdef MQTT_USE_TLS
+		strcpy(settings->MqttFingerprint, customMqttFingerprint.getValue());
+#endif
 		strcpy(settings->BaseTopic, customBaseTopic.getValue());
+		strcpy(settings->RemoteSensors, customRemoteSensors.getValue());
+		strcpy(settings->OutdoorTopic, customOutdoorTopic.getValue());
+		strcpy(settings->HeatCurve, customHeatCurve.getValue());
+		strcpy(settings->ColdCurve, customColdCurve.getValue());
 
 		SaveConfiguration(settings);
 	}
@@ -227,7 +507,7 @@ void SaveConfiguration(DeviceSettings* settings)
 {
 	DEBUG_FC_PRINTLN(F("Saving configuration..."));
 
-	File configFile = SPIFFS.open(CONFIG_FILE_NAME, "w");
+	File configFile = SPIFFS.open(FPSTR(CONFIG_FILE_NAME), "w");
 	if (!configFile) {
 		DEBUG_FC_PRINTLN(F("Failed to open a configuration file for writing."));
 		return;
@@ -235,16 +515,26 @@ void SaveConfiguration(DeviceSettings* settings)
 
 	DynamicJsonDocument json(2048);
 
-	json[MQTT_SERVER_KEY] = settings->MqttServer;
-	json[MQTT_PORT_KEY] = settings->MqttPort;
-	json[MQTT_CLIENT_ID_KEY] = settings->MqttClientId;
-	json[MQTT_USER_KEY] = settings->MqttUser;
-	json[MQTT_PASS_KEY] = settings->MqttPass;
-	json[BASE_TOPIC_KEY] = settings->BaseTopic;
+	json[FPSTR(MQTT_SERVER_KEY)] = settings->MqttServer;
+	json[FPSTR(MQTT_PORT_KEY)] = settings->MqttPort;
+	json[FPSTR(MQTT_FALLBACK_SERVERS_KEY)] = settings->MqttFallbackServers;
+	json[FPSTR(MQTT_CLIENT_ID_KEY)] = settings->MqttClientId;
+	json[FPSTR(MQTT_USER_KEY)] = settings->MqttUser;
+	json[FPSTR(MQTT_PASS_KEY)] = settings->MqttPass;
+	json[FPSTR(MQTT_FINGERPRINT_KEY)] = settings->MqttFingerprint;
+	json[FPSTR(BASE_TOPIC_KEY)] = settings->BaseTopic;
+	json[FPSTR(REMOTE_SENSORS_KEY)] = settings->RemoteSensors;
+	json[FPSTR(OUTDOOR_TOPIC_KEY)] = settings->OutdoorTopic;
+	json[FPSTR(HEAT_CURVE_KEY)] = settings->HeatCurve;
+	json[FPSTR(COLD_CURVE_KEY)] = settings->ColdCurve;
 
-	json[MODE_KEY] = settings->Mode;
-	json[DEVICE_STATE_KEY] = settings->DeviceState;
-	json[DESIRED_TEMPERATURE_KEY] = settings->DesiredTemperature;
+	for (uint8_t i = 0; i < DATA_FIELDS_LEN; i++)
+	{
+		if (DATA_FIELDS[i].SettingsKey != NULL)
+		{
+			json[FPSTR(DATA_FIELDS[i].SettingsKey)] = (const char*)settings + DATA_FIELDS[i].SettingsOffset;
+		}
+	}
 	
 	DEBUG_FC_PRINTLN(F("Configuration is saved."));
 
@@ -291,17 +581,690 @@ void initializeSensorData()
 	TemperatureData.DataCollectionLen = TEMPERATURE_ARRAY_LEN;
 	TemperatureData.Precision = TEMPERATURE_PRECISION;
 	TemperatureData.CheckDataIntervalMS = CHECK_TEMP_INTERVAL_MS;
-	TemperatureData.DataType = Temperature;
+	TemperatureData.SampleIntervalMS = CHECK_TEMP_INTERVAL_MS;
+	// Dew point is calculated from temperature and humidity averages.
+	TemperatureData.DataType = (DeviceData)(Temperature | DewPoint);
+	TemperatureData.Margin = temperatureMargin;
 
 	HumidityData.DataCollection = HumidityCollection;
 	HumidityData.DataCollectionLen = HUMIDITY_ARRAY_LEN;
 	HumidityData.Precision = HUMIDITY_PRECISION;
 	HumidityData.CheckDataIntervalMS = CHECK_HUMIDITY_INTERVAL_MS;
-	HumidityData.DataType = Humidity;
+	HumidityData.SampleIntervalMS = CHECK_HUMIDITY_INTERVAL_MS;
+	HumidityData.DataType = (DeviceData)(Humidity | DewPoint);
+	HumidityData.Margin = humidityMargin;
 
 	InletData.DataCollection = InletCollection;
 	InletData.DataCollectionLen = INLET_ARRAY_LEN;
 	InletData.Precision = INLET_PRECISION;
 	InletData.CheckDataIntervalMS = CHECK_INLET_INTERVAL_MS;
+	InletData.SampleIntervalMS = CHECK_INLET_INTERVAL_MS;
 	InletData.DataType = InletPipe;
+	InletData.Margin = inletMargin;
+}
+
+BufferPrint::BufferPrint(char * buffer, size_t size)
+{
+	_buffer = buffer;
+	_size = size;
+
+	if (_size > 0)
+	{
+		_buffer[0] = CH_NONE;
+	}
+}
+
+size_t BufferPrint::write(uint8_t c)
+{
+	if (_length + 1 >= _size)
+	{
+		_isOverflow = true;
+		return 0;
+	}
+
+	_buffer[_length++] = c;
+	_buffer[_length] = CH_NONE;
+
+	return 1;
+}
+
+size_t BufferPrint::length()
+{
+	return _length;
+}
+
+bool BufferPrint::isOverflow()
+{
+	return _isOverflow;
+}
+
+size_t CountPrint::write(uint8_t c)
+{
+	_count++;
+
+	return 1;
+}
+
+size_t CountPrint::write(const uint8_t * buffer, size_t size)
+{
+	_count += size;
+
+	return size;
+}
+
+size_t CountPrint::count()
+{
+	return _count;
+}
+
+ChunkPrint::ChunkPrint(Print & target) : _target(target)
+{
+}
+
+size_t ChunkPrint::write(uint8_t c)
+{
+	if (_length >= STREAM_CHUNK_LEN)
+	{
+		flush();
+	}
+
+	_buffer[_length++] = c;
+
+	return 1;
+}
+
+void ChunkPrint::flush()
+{
+	if (_length > 0)
+	{
+		_target.write(_buffer, _length);
+		_length = 0;
+	}
+}
+
+/**
+* @brief Rebuild a snapshot if data it depends on was changed after the last build.
+* @param snapshot The snapshot to rebuild.
+*
+* @return void
+*/
+void buildSnapshot(Snapshot * snapshot)
+{
+	if (snapshot->Dirty == 0)
+	{
+		return;
+	}
+
+	BufferPrint out(snapshot->Buffer, snapshot->Size);
+	snapshot->Writer(out);
+
+	snapshot->Length = out.length();
+	snapshot->IsOverflow = out.isOverflow();
+	snapshot->Dirty = 0;
+
+	if (snapshot->IsOverflow)
+	{
+		DEBUG_FC_PRINT(F("Error: snapshot buffer overflow, size: "));
+		DEBUG_FC_PRINTLN(snapshot->Size);
+	}
+}
+
+/**
+* @brief Format a fixed point number. Digits are got by subtracting powers of ten, without division.
+* @param value The number multiplied by 10^precision. Example: 235 with precision 1 is 23.5.
+* @param precision Digits after the decimal point.
+* @param buffer Result. It should have 13 chars at least.
+*
+* @return size_t The result length.
+*/
+size_t fixedToChars(int32_t value, uint8_t precision, char * buffer)
+{
+	char* out = buffer;
+	uint32_t rest = value;
+
+	if (value < 0)
+	{
+		*out++ = '-';
+		rest = -(uint32_t)value;
+	}
+
+	// The first not zero digit. Integer part has one digit at least.
+	int8_t digit = POW10_LEN - 1;
+	while (digit > precision && POW10[digit] > rest)
+	{
+		digit--;
+	}
+
+	for (; digit >= 0; digit--)
+	{
+		if (digit == precision - 1)
+		{
+			*out++ = '.';
+		}
+
+		char ch = '0';
+		while (rest >= POW10[digit])
+		{
+			rest -= POW10[digit];
+			ch++;
+		}
+
+		*out++ = ch;
+	}
+
+	*out = CH_NONE;
+
+	return out - buffer;
+}
+
+/**
+* @brief Format a float with the given precision. The result is the same as FloatToChars.
+* The value is rounded to fixed point with one multiplication and then it is formatted with fixedToChars.
+* @param value The number.
+* @param precision Digits after the decimal point.
+* @param buffer Result.
+*
+* @return size_t The result length.
+*/
+size_t floatToChars(float value, uint8_t precision, char * buffer)
+{
+	if (std::isnan(value))
+	{
+		strcpy_P(buffer, NOT_A_NUMBER);
+		return strlen_P(NOT_A_NUMBER);
+	}
+
+	int32_t fixed = lroundf(value * POW10[precision]);
+
+	// Negative values rounded to zero keep their sign: -0.04 -> -0.0
+	if (fixed == 0 && value < 0)
+	{
+		*buffer = '-';
+		return fixedToChars(0, precision, buffer + 1) + 1;
+	}
+
+	return fixedToChars(fixed, precision, buffer);
+}
+
+/**
+* @brief Parse a decimal number into fixed point, straight from the payload without copying.
+* Format: [+|-]digits[.digits]. Fraction digits after the precision round the result half up.
+* @param value The text. It is not null terminated.
+* @param length The text length.
+* @param precision Digits after the decimal point in the result.
+* @param min The minimum allowed result.
+* @param max The maximum allowed result.
+* @param result The number multiplied by 10^precision. Example: "23.46" with precision 1 is 235.
+*
+* @return bool true - the text is a valid number in the range. Otherwise result is not changed.
+*/
+bool parseFixed(const char * value, size_t length, uint8_t precision, int32_t min, int32_t max, int32_t * result)
+{
+	if (precision >= POW10_LEN)
+	{
+		return false;
+	}
+
+	const char* end = value + length;
+	bool isNegative = false;
+
+	if (value < end && (*value == '-' || *value == '+'))
+	{
+		isNegative = *value == '-';
+		value++;
+	}
+
+	// The biggest allowed absolute value. It keeps the number far from overflow.
+	uint32_t limit = isNegative ? (uint32_t)(-(int64_t)min) : (uint32_t)max;
+	if ((isNegative && min > 0) || (!isNegative && max < 0))
+	{
+		limit = 0;
+	}
+
+	// 64 bits: one more digit over a 32 bits limit does not overflow
+	uint64_t fixed = 0;
+	uint8_t digits = 0;
+	int8_t fraction = -1;
+	bool roundUp = false;
+
+	for (; value < end; value++)
+	{
+		char ch = *value;
+		if (ch == '.' && fraction < 0)
+		{
+			fraction = 0;
+			continue;
+		}
+
+		if (ch < '0' || ch > '9')
+		{
+			return false;
+		}
+
+		digits++;
+
+		if (fraction >= precision)
+		{
+			// Only the first dropped digit is used to round
+			if (fraction == precision)
+			{
+				roundUp = ch >= '5';
+			}
+
+			fraction = precision + 1;
+			continue;
+		}
+
+		if (fraction >= 0)
+		{
+			fraction++;
+		}
+
+		fixed = fixed * 10 + (ch - '0');
+
+		// Stop early - the limit can not be reached back
+		if (fixed > limit)
+		{
+			return false;
+		}
+	}
+
+	if (digits == 0 || fraction == 0)
+	{
+		return false;
+	}
+
+	// Scale up missing fraction digits
+	for (int8_t i = fraction < 0 ? 0 : fraction; i < precision; i++)
+	{
+		fixed *= 10;
+		if (fixed > limit)
+		{
+			return false;
+		}
+	}
+
+	if (roundUp && ++fixed > limit)
+	{
+		return false;
+	}
+
+	int64_t number = isNegative ? -(int64_t)fixed : (int64_t)fixed;
+	if (number < min || number > max)
+	{
+		return false;
+	}
+
+	*result = number;
+
+	return true;
+}
+
+/**
+* @brief Merge a command into other. Fields from source overwrite the target ones - the latest value wins.
+* @param target The command to merge in.
+* @param source The newer command.
+*
+* @return void
+*/
+void mergeCommand(DeviceCommand * target, DeviceCommand * source)
+{
+	// Copy the values of all fields in the source, as they are described in DATA_FIELDS
+	uint16_t fields = source->Fields;
+	while (fields != 0)
+	{
+		const DataField* field = &DATA_FIELDS[__builtin_ctz(fields)];
+		fields &= fields - 1;
+
+		memcpy((char*)target + field->CommandOffset, (const char*)source + field->CommandOffset, field->CommandLen);
+	}
+
+	target->Fields |= source->Fields;
+
+	if (source->CorrelationId[0] != CH_NONE)
+	{
+		strcpy(target->CorrelationId, source->CorrelationId);
+	}
+}
+
+void initTokenBucket(TokenBucket * bucket, uint16_t capacity, uint16_t refillIntervalMS)
+{
+	bucket->Capacity = capacity;
+	bucket->RefillIntervalMS = refillIntervalMS;
+	bucket->Tokens = capacity;
+	bucket->RefillTime = millis();
+	bucket->Limited = 0;
+}
+
+/**
+* @brief Take a token from a bucket. One token is added every RefillIntervalMS up to Capacity.
+* @param bucket The bucket.
+* @param isCounted Count a refusal in Limited. false - retry of already counted (coalesced) commands.
+*
+* @return bool true - there is a token, the command can be processed.
+*/
+bool takeToken(TokenBucket * bucket, bool isCounted)
+{
+	unsigned long now = millis();
+
+	if (bucket->Tokens < bucket->Capacity)
+	{
+		unsigned long tokens = (now - bucket->RefillTime) / bucket->RefillIntervalMS;
+		if (tokens > 0)
+		{
+			bucket->RefillTime += tokens * bucket->RefillIntervalMS;
+			tokens += bucket->Tokens;
+			bucket->Tokens = tokens < bucket->Capacity ? tokens : bucket->Capacity;
+		}
+	}
+	else
+	{
+		bucket->RefillTime = now;
+	}
+
+	if (bucket->Tokens == 0)
+	{
+		if (isCounted)
+		{
+			bucket->Limited++;
+		}
+
+		return false;
+	}
+
+	bucket->Tokens--;
+
+	return true;
+}
+
+/**
+* @brief FNV-1a hash of a string.
+* @param str The string.
+*
+* @return uint32_t The hash.
+*/
+uint32_t hashString(const char * str)
+{
+	uint32_t hash = 2166136261UL;
+	while (*str != CH_NONE)
+	{
+		hash ^= (uint8_t)*str++;
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+/**
+* @brief Get a topic without its last level. Example: flat/bedroom1 -> flat.
+* @param topic The topic.
+* @param parent Result. It should be long as topic.
+*
+* @return bool true - the topic has a parent.
+*/
+bool getParentTopic(const char * topic, char * parent)
+{
+	const char* last = strrchr(topic, TOPIC_SEPARATOR);
+	if (last == NULL || last == topic)
+	{
+		parent[0] = CH_NONE;
+		return false;
+	}
+
+	size_t len = last - topic;
+	memcpy(parent, topic, len);
+	parent[len] = CH_NONE;
+
+	return true;
+}
+
+/**
+* @brief Build a topic: <baseTopic>/<name>.
+* @param buffer Result.
+* @param baseTopic The topic start. If it is empty the result is /<name>.
+* @param name The last topic level in flash (PROGMEM).
+*
+* @return char* The buffer.
+*/
+char* buildTopic(char* buffer, const char* baseTopic, PGM_P name)
+{
+	strcpy(buffer, baseTopic);
+
+	return appendTopic(buffer, name);
+}
+
+/**
+* @brief Add a topic level: <buffer>/<name>.
+* @param buffer The topic. The level is added at the end.
+* @param name The topic level in flash (PROGMEM).
+*
+* @return char* The buffer.
+*/
+char* appendTopic(char* buffer, PGM_P name)
+{
+	size_t len = strlen(buffer);
+	buffer[len++] = TOPIC_SEPARATOR;
+	strcpy_P(buffer + len, name);
+
+	return buffer;
+}
+
+/**
+* @brief Find data published in a topic.
+* @param topic The topic without basetopic/ prefix. Example: temperature.
+*
+* @return DeviceData The data or 0 if the topic is not a data topic.
+*/
+DeviceData getDataByTopic(const char * topic)
+{
+	for (uint8_t i = 0; i < DATA_FIELDS_LEN; i++)
+	{
+		if (DATA_FIELDS[i].Topic != NULL && strcmp_P(topic, DATA_FIELDS[i].Topic) == 0)
+		{
+			return (DeviceData)(1 << i);
+		}
+	}
+
+	return (DeviceData)0;
+}
+
+/**
+* @brief Get a data field description.
+* @param data Only one DeviceData bit.
+*
+* @return const DataField* The field or NULL if data is not one data field.
+*/
+const DataField* getDataField(DeviceData data)
+{
+	if (data == 0 || (data & (data - 1)) != 0)
+	{
+		return NULL;
+	}
+
+	uint8_t index = __builtin_ctz(data);
+	if (index >= DATA_FIELDS_LEN || DATA_FIELDS[index].Topic == NULL)
+	{
+		return NULL;
+	}
+
+	return &DATA_FIELDS[index];
+}
+
+/**
+* @brief Compare a not null terminated payload with a string in flash (PROGMEM).
+*
+* @return bool true - they are equal.
+*/
+bool isPayloadEqual(const char * payload, size_t length, PGM_P str)
+{
+	return strlen_P(str) == length && strncmp_P(payload, str, length) == 0;
+}
+
+/**
+* @brief Parse mode: heat, cold.
+*
+* @return bool true - the value is valid.
+*/
+bool parseMode(const char * value, size_t length, DeviceCommand * command)
+{
+	if (isPayloadEqual(value, length, PAYLOAD_HEAT))
+	{
+		command->DeviceMode = Heat;
+	}
+	else if (isPayloadEqual(value, length, PAYLOAD_COLD))
+	{
+		command->DeviceMode = Cold;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+/**
+* @brief Parse device state: on, off.
+*
+* @return bool true - the value is valid.
+*/
+bool parseDeviceState(const char * value, size_t length, DeviceCommand * command)
+{
+	if (isPayloadEqual(value, length, PAYLOAD_ON))
+	{
+		command->State = On;
+	}
+	else if (isPayloadEqual(value, length, PAYLOAD_OFF))
+	{
+		command->State = Off;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+/**
+* @brief Parse desired temperature: 22.5. It should be between MIN_DESIRED_TEMPERATURE and MAX_DESIRED_TEMPERATURE.
+*
+* @return bool true - the value is valid.
+*/
+bool parseDesiredTemperature(const char * value, size_t length, DeviceCommand * command)
+{
+	int32_t fixed;
+	if (!parseFixed(value, length, TEMPERATURE_PRECISION,
+		MIN_DESIRED_TEMPERATURE * POW10[TEMPERATURE_PRECISION], MAX_DESIRED_TEMPERATURE * POW10[TEMPERATURE_PRECISION], &fixed))
+	{
+		return false;
+	}
+
+	command->DesiredTemperature = (float)fixed / POW10[TEMPERATURE_PRECISION];
+
+	return true;
+}
+
+/**
+* @brief Parse humidity limit: 0 - off, 1..100 %RH.
+*
+* @return bool true - the value is valid.
+*/
+bool parseHumidityLimit(const char * value, size_t length, DeviceCommand * command)
+{
+	int32_t fixed;
+	if (!parseFixed(value, length, 0, 0, 100, &fixed))
+	{
+		return false;
+	}
+
+	command->MaxHumidity = fixed;
+
+	return true;
+}
+
+/**
+* @brief Parse a command field value with the field parser.
+* @param field The field. Only fields with a parser can be set: CurrentMode (heat, cold), CurrentDeviceState (on, off), DesiredTemp (22.5),
+* HumidityLimit (60).
+* @param value The value. It is not null terminated.
+* @param length The value length.
+* @param command Result. The field flag is added to command Fields.
+*
+* @return bool true - the value is valid.
+*/
+bool parseCommandValue(DeviceData field, const char * value, size_t length, DeviceCommand * command)
+{
+	const DataField* dataField = getDataField(field);
+	if (dataField == NULL || dataField->Parse == NULL || !dataField->Parse(value, length, command))
+	{
+		return false;
+	}
+
+	command->Fields |= field;
+
+	return true;
+}
+
+/**
+* @brief Parse a multi field command: mode=heat;state=on;desiredtemp=22.5;id=42.
+* All fields are parsed even if some of them are not valid, to get the correlation ID.
+* @param payload The payload. It is not null terminated.
+* @param length The payload length.
+* @param command Result.
+* @param isIdOnly Only the correlation ID is allowed, other fields are not valid and not parsed.
+* It is the suffix of a single field command: basetopic/mode/set:heat;id=42.
+*
+* @return bool true - all fields are valid.
+*/
+bool parseCommand(const char * payload, size_t length, DeviceCommand * command, bool isIdOnly)
+{
+	char name[COMMAND_NAME_LEN];
+	size_t pos = 0;
+	bool isValid = true;
+
+	while (pos < length)
+	{
+		// Field end
+		size_t end = pos;
+		while (end < length && payload[end] != PAYLOAD_SEPARATOR)
+		{
+			end++;
+		}
+
+		const char* assign = (const char*)memchr(payload + pos, PAYLOAD_ASSIGN, end - pos);
+		size_t nameLen = assign == NULL ? 0 : assign - (payload + pos);
+
+		if (nameLen == 0 || nameLen >= COMMAND_NAME_LEN)
+		{
+			isValid = false;
+			pos = end + 1;
+			continue;
+		}
+
+		memcpy(name, payload + pos, nameLen);
+		name[nameLen] = CH_NONE;
+
+		const char* value = assign + 1;
+		size_t valueLen = payload + end - value;
+
+		if (strcmp_P(name, PAYLOAD_COMMAND_ID) == 0)
+		{
+			if (valueLen >= COMMAND_ID_LEN)
+			{
+				valueLen = COMMAND_ID_LEN - 1;
+			}
+
+			memcpy(command->CorrelationId, value, valueLen);
+			command->CorrelationId[valueLen] = CH_NONE;
+		}
+		else if (isIdOnly || !parseCommandValue(getDataByTopic(name), value, valueLen, command))
+		{
+			isValid = false;
+		}
+
+		pos = end + 1;
+	}
+
+	return isValid;
 }
\ No newline at end of file
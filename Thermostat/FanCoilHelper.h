@@ -12,6 +12,10 @@
 // TODO: Debug is stopped.
 #define WIFIFCMM_DEBUG
 
+// Uncomment to connect to MQTT server over TLS. The server certificate is pinned by MqttFingerprint setting.
+// Usually TLS MQTT port is 8883.
+//#define MQTT_USE_TLS
+
 // Define where debug output will be printed.
 #define DEBUG_FC Serial
 
@@ -38,14 +42,25 @@
 
 #define MQTT_SERVER_LEN 40
 #define MQTT_PORT_LEN 8
+#define MQTT_FALLBACK_SERVERS_LEN 96
+#define REMOTE_SENSORS_LEN 160
+#define OUTDOOR_TOPIC_LEN 64
+#define WEATHER_CURVE_SETTING_LEN 64
 #define MQTT_CLIENT_ID_LEN 32
 #define MQTT_USER_LEN 16
 #define MQTT_PASS_LEN 16
+// SHA1 fingerprint of the server certificate. Format: "AA:BB:...:FF"
+#define MQTT_FINGERPRINT_LEN 60
 #define BASE_TOPIC_LEN 32
 #define INLET_SENSOR_CRC_LEN 16
 #define MODE_LEN 8
 #define DEVICE_STATE_LEN 8
 #define DESIRED_TEMPERATURE_LEN 8
+#define MAX_HUMIDITY_LEN 4
+#define COMMAND_NAME_LEN 16
+#define COMMAND_VALUE_LEN 16
+#define COMMAND_ID_LEN 16
+#define PING_TOKEN_LEN 16
 
 #define TEMPERATURE_ARRAY_LEN 10
 #define TEMPERATURE_PRECISION 1
@@ -59,6 +74,26 @@
 #define INLET_PRECISION 0
 #define CHECK_INLET_INTERVAL_MS CHECK_TEMP_INTERVAL_MS
 
+// Sensors are read only for the next averaging tick. Reads averaged into one collected value, 1 - a single read per tick.
+#define SENSOR_OVERSAMPLING 1
+// Interval between oversampling reads. DHT22 returns the same value if it is read more often than 2000 ms.
+#define SENSOR_OVERSAMPLING_INTERVAL_MS 2000
+
+// Adaptive sampling. A channel interval is from CHECK_*_INTERVAL_MS up to this factor times it. 1 - fixed interval.
+#define ADAPTIVE_MAX_INTERVAL_FACTOR 6
+// Trend weight of the last sample (EWMA)
+#define ADAPTIVE_SLOPE_WEIGHT 0.3
+// A trend less than this (units per hour) is taken as this, so a value close to a threshold is sampled faster.
+#define ADAPTIVE_MIN_SLOPE 2.0
+// Distance to a decision (in channel units) for a channel without thresholds
+#define ADAPTIVE_FREE_MARGIN 5.0
+
+// DATA_FIELDS rows: one per DeviceData bit
+#define DATA_FIELDS_LEN 13
+
+// Powers of ten used to format fixed point numbers. Precision should be less than this.
+#define POW10_LEN 10
+
 #define OK_INTERVAL_MS 60000
 
 #define WAIT_FOR_CONNECT_BEFORE_OFF_MS 360000 // 1 hour
@@ -68,46 +103,160 @@
 #define MIN_DESIRED_TEMPERATURE 15.0
 #define MAX_DESIRED_TEMPERATURE 30.0
 
+// Dehumidifying in Cold mode starts above the humidity limit and stops below the limit - DEHUMIDIFY_HYSTERESIS (%RH).
+#define DEHUMIDIFY_HYSTERESIS 5
+// The lowest fan degree while dehumidifying
+#define DEHUMIDIFY_FAN_DEGREE 1
+// Dehumidifying stops if the room is colder than desired by this (°C).
+#define DEHUMIDIFY_MAX_OVERCOOL 1.5
+
+// Temperature and humidity sensor. Uncomment one of I2C sensors, otherwise DHT22 is used.
+// SHT3x and BME280 are read without disabling interrupts and faster than DHT22.
+//#define CLIMATE_SENSOR_SHT3X
+//#define CLIMATE_SENSOR_BME280
+
 #define DHT_SENSORS_PIN EXT_GROVE_D0
 #define DHT_SENSORS_TYPE DHT22
 
+// I2C sensors are connected to Grove port. The inlet OneWire sensor (ONEWIRE_SENSORS_PIN) should be moved to other free pin.
+#define I2C_SDA_PIN EXT_GROVE_D0
+#define I2C_SCL_PIN EXT_GROVE_D1
+#define I2C_CLOCK_HZ 100000
+
 // Thermometer Resolution in bits. http://datasheets.maximintegrated.com/en/ds/DS18B20.pdf page 8.
 // Bits - CONVERSION TIME. 9 - 93.75ms (0.5°C), 10 - 187.5ms (0.25°C), 11 - 375ms (0.125°C), 12 - 750ms (0.0625°C).
 #define ONEWIRE_TEMPERATURE_PRECISION 10
 #define ONEWIRE_SENSORS_PIN EXT_GROVE_D1
 
-const char MQTT_SERVER_KEY[] = "mqttServer";
-const char MQTT_PORT_KEY[] = "mqttPort";
-const char MQTT_CLIENT_ID_KEY[] = "mqttClientId";
-const char MQTT_USER_KEY[] = "mqttUser";
-const char MQTT_PASS_KEY[] = "mqttPass";
-const char BASE_TOPIC_KEY[] = "baseTopic";
-const char MODE_KEY[] = "mode";
-const char DEVICE_STATE_KEY[] = "state";
-const char DESIRED_TEMPERATURE_KEY[] = "desiredTemp";
-const char CONFIG_FILE_NAME[] = "/config.json";
-
-const char TOPIC_SEPARATOR[] = "/";
-const char TOPIC_HUMIDITY[] = "humidity";
-const char TOPIC_DESIRED_TEMPERATURE[] = "desiredtemp";
-const char TOPIC_BYPASS_STATE[] = "bypassstate";
-const char TOPIC_TEMPERATURE[] = "temperature";
-const char TOPIC_SET[] = "set";
-const char TOPIC_MODE[] = "mode";
-const char TOPIC_DEVICE_STATE[] = "state";
-const char TOPIC_FAN_DEGREE[] = "fandegree";
-const char TOPIC_INLET_TEMPERATURE[] = "inlettemp";
-const char PAYLOAD_HEAT[] = "heat";
-const char PAYLOAD_COLD[] = "cold";
-const char PAYLOAD_ON[] = "on";
-const char PAYLOAD_OFF[] = "off";
-const char PAYLOAD_READY[] = "ready";
-const char PAYLOAD_OK[] = "ok";
-
-const char EVERY_ONE_LEVEL_TOPIC[] = "+";
-const char NOT_AVILABLE[] = "N/A";
-
-const char MUST_BE_ONE[] = "Must be one";
+#define MQTT_RECONNECT_INTERVAL_MS 5000
+// Data topics are retained. New subscribers get the last values from the server.
+#define MQTT_RETAIN_STATE true
+#define MQTT_WILL_QOS 1
+// TLS record buffers if the server supports Maximum Fragment Length Negotiation (MFLN). Otherwise 16K buffers are used.
+#define MQTT_TLS_BUFFER_LEN 512
+// MQTT client buffer. It should keep the biggest incoming message - OTA chunk (OTA_MAX_CHUNK_LEN) and its topic.
+#define MQTT_BUFFER_SIZE 1664
+
+// Command rate limits: bucket size (burst) and time to get one more command.
+#define SET_COMMANDS_BURST 5
+#define SET_COMMAND_INTERVAL_MS 1000
+#define GET_COMMANDS_BURST 10
+#define GET_COMMAND_INTERVAL_MS 200
+#define PING_COMMANDS_BURST 5
+#define PING_COMMAND_INTERVAL_MS 1000
+
+// Broadcast responses are spread in this time. Every device has own delay calculated from its client ID.
+#define BROADCAST_JITTER_MS 5000
+// Broadcasts received in this time after the last response are dropped.
+#define BROADCAST_DEDUP_WINDOW_MS 30000
+
+#define HTTP_SERVER_PORT 80
+#define STATUS_SNAPSHOT_LEN 256
+#define METRICS_SNAPSHOT_LEN 1024
+// Streamed payloads are sent to the network on parts with this size.
+#define STREAM_CHUNK_LEN 64
+// The longest HTTP content type
+#define CONTENT_TYPE_LEN 32
+
+// Protocol strings are in flash (PROGMEM) to save DRAM. They are defined in FanCoilHelper.cpp.
+// Use them with the _P string functions (strcmp_P, strcpy_P...) and FPSTR, never with the RAM ones.
+extern const char MQTT_SERVER_KEY[];
+extern const char MQTT_PORT_KEY[];
+extern const char MQTT_FALLBACK_SERVERS_KEY[];
+extern const char REMOTE_SENSORS_KEY[];
+extern const char REMOTE_SENSOR_LOCAL[];
+extern const char OUTDOOR_TOPIC_KEY[];
+extern const char HEAT_CURVE_KEY[];
+extern const char COLD_CURVE_KEY[];
+extern const char MQTT_CLIENT_ID_KEY[];
+extern const char MQTT_USER_KEY[];
+extern const char MQTT_PASS_KEY[];
+extern const char MQTT_FINGERPRINT_KEY[];
+extern const char BASE_TOPIC_KEY[];
+extern const char MODE_KEY[];
+extern const char DEVICE_STATE_KEY[];
+extern const char DESIRED_TEMPERATURE_KEY[];
+extern const char MAX_HUMIDITY_KEY[];
+extern const char CONFIG_FILE_NAME[];
+
+const char TOPIC_SEPARATOR = '/';
+extern const char TOPIC_HUMIDITY[];
+extern const char TOPIC_DESIRED_TEMPERATURE[];
+extern const char TOPIC_BYPASS_STATE[];
+extern const char TOPIC_WINDOW_OPEN[];
+extern const char TOPIC_HUMIDITY_LIMIT[];
+extern const char TOPIC_DEW_POINT[];
+extern const char TOPIC_TEMPERATURE[];
+extern const char TOPIC_SET[];
+extern const char TOPIC_GET[];
+extern const char TOPIC_MODE[];
+extern const char TOPIC_DEVICE_STATE[];
+extern const char TOPIC_FAN_DEGREE[];
+extern const char TOPIC_INLET_TEMPERATURE[];
+extern const char TOPIC_STATUS[];
+extern const char TOPIC_AVAILABILITY[];
+extern const char TOPIC_ACK[];
+extern const char TOPIC_PING[];
+extern const char TOPIC_PONG[];
+extern const char PAYLOAD_HEAT[];
+extern const char PAYLOAD_COLD[];
+extern const char PAYLOAD_ON[];
+extern const char PAYLOAD_OFF[];
+extern const char PAYLOAD_ONLINE[];
+extern const char PAYLOAD_OFFLINE[];
+extern const char PAYLOAD_OK[];
+extern const char PAYLOAD_ERROR[];
+extern const char PAYLOAD_COALESCED[];
+const char PAYLOAD_SEPARATOR = ';';
+const char PAYLOAD_ASSIGN = '=';
+extern const char PAYLOAD_COMMAND_ID[];
+
+extern const char TOPIC_OTA[];
+extern const char TOPIC_OTA_BEGIN[];
+extern const char TOPIC_OTA_CHUNK[];
+extern const char TOPIC_OTA_END[];
+extern const char TOPIC_OTA_ABORT[];
+extern const char TOPIC_OTA_STATE[];
+extern const char PAYLOAD_OTA_RECEIVING[];
+extern const char PAYLOAD_OTA_DONE[];
+
+extern const char HTTP_STATUS_PATH[];
+extern const char HTTP_METRICS_PATH[];
+extern const char CONTENT_TYPE_JSON[];
+extern const char CONTENT_TYPE_TEXT[];
+extern const char TOPIC_METRICS[];
+extern const char METRICS_PREFIX[];
+extern const char METRIC_LIMITED_SET[];
+extern const char METRIC_LIMITED_GET[];
+extern const char METRIC_LIMITED_PING[];
+extern const char METRIC_SENSOR_READ[];
+extern const char METRIC_SENSOR_READS[];
+extern const char METRIC_ENERGY[];
+extern const char METRIC_SLEEP[];
+extern const char METRIC_HEAT[];
+extern const char METRIC_COOL[];
+extern const char METRIC_BYPASS_ON[];
+extern const char METRIC_ROOM_TEMPERATURE[];
+extern const char METRIC_OUTDOOR_TEMPERATURE[];
+extern const char METRIC_DESIRED_OFFSET[];
+
+extern const char TOPIC_RUNTIME[];
+extern const char RUNTIME_FILE_NAME[];
+extern const char RUNTIME_FAN_DEGREE_KEY[];
+extern const char RUNTIME_BYPASS_ON_KEY[];
+extern const char RUNTIME_HEAT_WH_KEY[];
+extern const char RUNTIME_COOL_WH_KEY[];
+extern const char RUNTIME_HEAT_J_KEY[];
+extern const char RUNTIME_COOL_J_KEY[];
+
+extern const char EVERY_ONE_LEVEL_TOPIC[];
+extern const char EVERY_MULTI_LEVEL_TOPIC[];
+extern const char NOT_AVILABLE[];
+
+extern const char MUST_BE_ONE[];
+extern const char NOT_A_NUMBER[];
+
+const uint32_t POW10[POW10_LEN] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
 
 const float FAN_SWITCH_LEVEL[FAN_SWITCH_LEVEL_LEN] = {0, 0.3, 0.9};
 
@@ -134,22 +283,164 @@ enum DeviceData
 	Humidity = 64,
 	DeviceIsReady = 128,
 	DeviceOk = 256,
-	BypassState = 512
+	BypassState = 512,
+	WindowOpen = 1024,
+	HumidityLimit = 2048,
+	DewPoint = 4096
+};
+
+// All data sent with basetopic request.
+const DeviceData ALL_DATA = (DeviceData)(Temperature | DesiredTemp | FanDegree | CurrentMode | CurrentDeviceState | Humidity | InletPipe | BypassState | WindowOpen | HumidityLimit | DewPoint);
+
+struct DeviceCommand
+{
+	// DeviceData flags of fields in the command
+	uint16_t Fields = 0;
+	Mode DeviceMode;
+	DeviceState State;
+	float DesiredTemperature;
+	uint8_t MaxHumidity;
+	// Correlation ID. If it is set, the device sends acknowledgement basetopic/ack: <id>;<result>;<processing time us>
+	char CorrelationId[COMMAND_ID_LEN] = "";
+};
+
+enum FieldFormat
+{
+	// Average sensor value. Modes and states are text: heat, on...
+	FormatAverage,
+	// Current sensor value. Modes and states are text.
+	FormatCurrent,
+	// Number for metrics. Modes and states are numbers: heat - 0, cold - 1, off - 0, on - 1.
+	FormatMetric
+};
+
+// Format a data field value. buffer is used for numbers. Returns NULL if the value does not exist (no sensor).
+typedef const char *(*fieldFormatter)(char *buffer, FieldFormat format);
+// Parse a data field value into the command. value is not null terminated. Returns false if the value is not valid.
+typedef bool (*fieldParser)(const char *value, size_t length, DeviceCommand *command);
+
+struct DataField
+{
+	// basetopic/<topic>. NULL - the DeviceData bit is not a data field.
+	const char *Topic;
+	fieldFormatter Format;
+	// The status JSON value is a string
+	bool IsString;
+	// basetopic/<topic>/set parser. NULL - read only field.
+	fieldParser Parse;
+	// Configuration key of a saved field. NULL - the field is not saved.
+	const char *SettingsKey;
+	// The saved value in DeviceSettings
+	size_t SettingsOffset;
+	size_t SettingsLen;
+	// The parsed value in DeviceCommand. Used to merge commands.
+	size_t CommandOffset;
+	size_t CommandLen;
+};
+
+// Snapshot dirty flag for data which is not published, like counters.
+const uint16_t SNAPSHOT_COUNTERS = 0x8000;
+
+enum CommandClass
+{
+	CommandSet = 0,
+	CommandGet = 1,
+	CommandPing = 2,
+	CommandClassCount = 3
+};
+
+struct TokenBucket
+{
+	// Maximum tokens - allowed burst
+	uint16_t Capacity;
+	// Time to get one token
+	uint16_t RefillIntervalMS;
+	// Available tokens
+	uint16_t Tokens;
+	// Time of the last added token
+	unsigned long RefillTime;
+	// Received commands over the limit. They are dropped or coalesced.
+	uint32_t Limited;
 };
 
 struct DeviceSettings
 {
 	char MqttServer[MQTT_SERVER_LEN] = "x.cloudmqtt.com";
 	char MqttPort[MQTT_PORT_LEN] = "1883";
+	// Servers used if MqttServer is not available. Format: "host:port;host:port"
+	char MqttFallbackServers[MQTT_FALLBACK_SERVERS_LEN] = "";
 	char MqttClientId[MQTT_CLIENT_ID_LEN] = "ESP8266Client";
 	char MqttUser[MQTT_USER_LEN] = "user";
 	char MqttPass[MQTT_PASS_LEN] = "pass";
+	char MqttFingerprint[MQTT_FINGERPRINT_LEN] = "";
 	char BaseTopic[BASE_TOPIC_LEN] = "flat/bedroom1";
+	// Other temperature topics for the room temperature. Format: "topic=weight;topic=weight", "local=weight" - the local sensor
+	char RemoteSensors[REMOTE_SENSORS_LEN] = "";
+	// Outdoor temperature topic for weather compensation. Empty - off.
+	char OutdoorTopic[OUTDOOR_TOPIC_LEN] = "";
+	// Weather compensation curves. Format: "outdoor=offset;outdoor=offset" in °C, outdoor ascending. Empty - the default curve.
+	char HeatCurve[WEATHER_CURVE_SETTING_LEN] = "";
+	char ColdCurve[WEATHER_CURVE_SETTING_LEN] = "";
 	char Mode[MODE_LEN] = "cold";
 	char DeviceState[DEVICE_STATE_LEN] = "off";
 	char DesiredTemperature[DESIRED_TEMPERATURE_LEN] = "22";
+	// Humidity limit for dehumidifying in Cold mode, %RH. 0 - off.
+	char MaxHumidity[MAX_HUMIDITY_LEN] = "0";
+};
+
+// Data field formatters. They are implemented in the sketch, next to the device state.
+const char *formatTemperature(char *buffer, FieldFormat format);
+const char *formatHumidity(char *buffer, FieldFormat format);
+const char *formatInletTemperature(char *buffer, FieldFormat format);
+const char *formatFanDegree(char *buffer, FieldFormat format);
+const char *formatDesiredTemperature(char *buffer, FieldFormat format);
+const char *formatMode(char *buffer, FieldFormat format);
+const char *formatDeviceState(char *buffer, FieldFormat format);
+const char *formatBypassState(char *buffer, FieldFormat format);
+const char *formatWindowOpen(char *buffer, FieldFormat format);
+const char *formatHumidityLimit(char *buffer, FieldFormat format);
+const char *formatDewPoint(char *buffer, FieldFormat format);
+
+bool parseMode(const char *value, size_t length, DeviceCommand *command);
+bool parseDeviceState(const char *value, size_t length, DeviceCommand *command);
+bool parseDesiredTemperature(const char *value, size_t length, DeviceCommand *command);
+bool parseHumidityLimit(const char *value, size_t length, DeviceCommand *command);
+
+// Sensor channel decision margins. They are implemented in the sketch, next to the control logic.
+float temperatureMargin(float value);
+float inletMargin(float value);
+float humidityMargin(float value);
+
+// Data fields indexed by DeviceData bit position: DATA_FIELDS[__builtin_ctz(data)].
+// basetopic/<topic> publishes the field, basetopic/<topic>/get requests it and basetopic/<topic>/set changes it.
+constexpr DataField DATA_FIELDS[DATA_FIELDS_LEN] = {
+	/* Temperature */ { TOPIC_TEMPERATURE, formatTemperature, false, NULL, NULL, 0, 0, 0, 0 },
+	/* DesiredTemp */ { TOPIC_DESIRED_TEMPERATURE, formatDesiredTemperature, false, parseDesiredTemperature,
+		DESIRED_TEMPERATURE_KEY, offsetof(DeviceSettings, DesiredTemperature), DESIRED_TEMPERATURE_LEN,
+		offsetof(DeviceCommand, DesiredTemperature), sizeof(DeviceCommand::DesiredTemperature) },
+	/* InletPipe */ { TOPIC_INLET_TEMPERATURE, formatInletTemperature, false, NULL, NULL, 0, 0, 0, 0 },
+	/* FanDegree */ { TOPIC_FAN_DEGREE, formatFanDegree, false, NULL, NULL, 0, 0, 0, 0 },
+	/* CurrentMode */ { TOPIC_MODE, formatMode, true, parseMode, MODE_KEY, offsetof(DeviceSettings, Mode), MODE_LEN,
+		offsetof(DeviceCommand, DeviceMode), sizeof(DeviceCommand::DeviceMode) },
+	/* CurrentDeviceState */ { TOPIC_DEVICE_STATE, formatDeviceState, true, parseDeviceState,
+		DEVICE_STATE_KEY, offsetof(DeviceSettings, DeviceState), DEVICE_STATE_LEN,
+		offsetof(DeviceCommand, State), sizeof(DeviceCommand::State) },
+	/* Humidity */ { TOPIC_HUMIDITY, formatHumidity, false, NULL, NULL, 0, 0, 0, 0 },
+	/* DeviceIsReady */ { NULL, NULL, false, NULL, NULL, 0, 0, 0, 0 },
+	/* DeviceOk */ { NULL, NULL, false, NULL, NULL, 0, 0, 0, 0 },
+	/* BypassState */ { TOPIC_BYPASS_STATE, formatBypassState, true, NULL, NULL, 0, 0, 0, 0 },
+	/* WindowOpen */ { TOPIC_WINDOW_OPEN, formatWindowOpen, true, NULL, NULL, 0, 0, 0, 0 },
+	/* HumidityLimit */ { TOPIC_HUMIDITY_LIMIT, formatHumidityLimit, false, parseHumidityLimit,
+		MAX_HUMIDITY_KEY, offsetof(DeviceSettings, MaxHumidity), MAX_HUMIDITY_LEN,
+		offsetof(DeviceCommand, MaxHumidity), sizeof(DeviceCommand::MaxHumidity) },
+	/* DewPoint */ { TOPIC_DEW_POINT, formatDewPoint, false, NULL, NULL, 0, 0, 0, 0 }
 };
 
+/**
+* @brief Distance from a channel value to the nearest control decision (threshold). NAN - no decision depends on it.
+*/
+typedef float(*decisionMargin) (float value);
+
 struct SensorData
 {
 	// Current measured value
@@ -168,12 +459,94 @@ struct SensorData
 	uint Precision;
 	// Check value interval
 	uint CheckDataIntervalMS;
-	// Stored in this structure data type
+	// Data published when the average changes
 	DeviceData DataType;
 	// DS18B20 device address
 	uint8_t Address[8];
 	// Is true, if the sensor exists
 	bool IsExists;
+	// Sum of the oversampling reads for the next tick
+	float SampleSum = 0;
+	// Count of the oversampling reads for the next tick
+	uint8_t SampleCount = 0;
+	// Time of the last oversampling read
+	unsigned long SampleTime = 0;
+	// Current sample interval, adapted from CheckDataIntervalMS
+	uint SampleIntervalMS;
+	// Smoothed trend, units per hour
+	float Slope = 0;
+	// Value and time of the last tick, to calculate the trend
+	float SlopeValue;
+	unsigned long SlopeTime = 0;
+	// Distance to the nearest decision, NULL - none
+	decisionMargin Margin = NULL;
+};
+
+typedef void(*dataWriter) (Print& out);
+
+struct Snapshot
+{
+	// A buffer which keeps the prebuilt response
+	char *Buffer;
+	// The buffer size
+	size_t Size;
+	// Length of the prebuilt response
+	size_t Length;
+	// DeviceData flags changed after the last build. Rebuild only if not 0.
+	uint16_t Dirty;
+	// Writes the response content
+	dataWriter Writer;
+	// The response did not fit in the buffer at the last build
+	bool IsOverflow;
+};
+
+/**
+* @brief Print into a fixed size char buffer. The buffer is always null terminated, overflowed data is dropped
+* and isOverflow() returns true.
+*/
+class BufferPrint : public Print
+{
+private:
+	char *_buffer;
+	size_t _size;
+	size_t _length = 0;
+	bool _isOverflow = false;
+public:
+	BufferPrint(char *buffer, size_t size);
+
+	size_t write(uint8_t c) override;
+	size_t length();
+	bool isOverflow();
+};
+
+/**
+* @brief Print which only counts written bytes. It is used to get a streamed payload length.
+*/
+class CountPrint : public Print
+{
+private:
+	size_t _count = 0;
+public:
+	size_t write(uint8_t c) override;
+	size_t write(const uint8_t *buffer, size_t size) override;
+	size_t count();
+};
+
+/**
+* @brief Print which collects written bytes into a small buffer and sends them to the target on parts.
+* Call flush() after the last write.
+*/
+class ChunkPrint : public Print
+{
+private:
+	Print &_target;
+	uint8_t _buffer[STREAM_CHUNK_LEN];
+	size_t _length = 0;
+public:
+	ChunkPrint(Print &target);
+
+	size_t write(uint8_t c) override;
+	void flush() override;
 };
 
 extern SensorData TemperatureData;
@@ -192,6 +565,13 @@ void printTopicAndPayload(const char *operationName, const char *topic, char *pa
 bool connectWiFi();
 
 float calcAverage(float *data, uint8 dataLength, uint8 precision);
+long timeToDeadline(unsigned long deadline);
+bool isSampleDue(SensorData *data);
+unsigned long timeToSample(SensorData *data);
+void addSample(SensorData *data, float value);
+void resetSamples(SensorData *data);
+void updateSampleInterval(SensorData *data);
+void resetSampleInterval(SensorData *data);
 
 void ReadConfiguration(DeviceSettings *settings);
 bool mangeConnectAndSettings(WiFiManager *wifiManager, DeviceSettings *settings, int waitingWiFiInSec);
@@ -202,4 +582,27 @@ void setArrayValues(SensorData *sensor);
 
 void initializeSensorData();
 
+void buildSnapshot(Snapshot *snapshot);
+
+size_t fixedToChars(int32_t value, uint8_t precision, char *buffer);
+size_t floatToChars(float value, uint8_t precision, char *buffer);
+bool parseFixed(const char *value, size_t length, uint8_t precision, int32_t min, int32_t max, int32_t *result);
+
+char *buildTopic(char *buffer, const char *baseTopic, PGM_P name);
+char *appendTopic(char *buffer, PGM_P name);
+
+DeviceData getDataByTopic(const char *topic);
+const DataField *getDataField(DeviceData data);
+
+bool isPayloadEqual(const char *payload, size_t length, PGM_P str);
+bool parseCommandValue(DeviceData field, const char *value, size_t length, DeviceCommand *command);
+bool parseCommand(const char *payload, size_t length, DeviceCommand *command, bool isIdOnly);
+void mergeCommand(DeviceCommand *target, DeviceCommand *source);
+
+void initTokenBucket(TokenBucket *bucket, uint16_t capacity, uint16_t refillIntervalMS);
+bool takeToken(TokenBucket *bucket, bool isCounted);
+
+uint32_t hashString(const char *str);
+bool getParentTopic(const char *topic, char *parent);
+
 #endif
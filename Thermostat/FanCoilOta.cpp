@@ -0,0 +1,266 @@
+// 
+// 
+// 
+
+#include "FanCoilOta.h"
+#include "KMPCommon.h"
+#include <Updater.h>
+
+char _otaTopicBuff[BASE_TOPIC_LEN + 16];
+char _otaPayloadBuff[OTA_STATE_PAYLOAD_LEN];
+
+void FanCoilOtaClass::init(const char* baseTopic, callBackMqttPublish publish)
+{
+	_baseTopic = baseTopic;
+	_publish = publish;
+}
+
+bool FanCoilOtaClass::isInProgress()
+{
+	return _size > 0;
+}
+
+/**
+* @brief Process an OTA topic.
+* @param topic The topic without basetopic/ prefix.
+* @param payload The payload data. It is written to the flash directly, without copying.
+* @param length A payload length.
+*
+* @return bool true - the topic is an OTA topic and it is processed.
+**/
+bool FanCoilOtaClass::processTopic(char* topic, byte* payload, unsigned int length)
+{
+	size_t otaLen = strlen_P(TOPIC_OTA);
+	if (strncmp_P(topic, TOPIC_OTA, otaLen) != 0 || topic[otaLen] != TOPIC_SEPARATOR)
+	{
+		return false;
+	}
+
+	const char* command = topic + otaLen + 1;
+
+	if (strcmp_P(command, TOPIC_OTA_BEGIN) == 0)
+	{
+		begin(payload, length);
+		return true;
+	}
+
+	if (strcmp_P(command, TOPIC_OTA_END) == 0)
+	{
+		end();
+		return true;
+	}
+
+	if (strcmp_P(command, TOPIC_OTA_ABORT) == 0)
+	{
+		abort();
+		return true;
+	}
+
+	size_t chunkLen = strlen_P(TOPIC_OTA_CHUNK);
+	if (strncmp_P(command, TOPIC_OTA_CHUNK, chunkLen) == 0 && command[chunkLen] == TOPIC_SEPARATOR)
+	{
+		writeChunk(command + chunkLen + 1, payload, length);
+	}
+
+	return true;
+}
+
+void FanCoilOtaClass::begin(byte* payload, unsigned int length)
+{
+	// Payload: <size>;<md5>. Copy it, it is not null terminated.
+	if (length >= OTA_STATE_PAYLOAD_LEN)
+	{
+		publishState(PAYLOAD_ERROR);
+		return;
+	}
+
+	memcpy(_otaPayloadBuff, payload, length);
+	_otaPayloadBuff[length] = CH_NONE;
+
+	char* md5 = strchr(_otaPayloadBuff, PAYLOAD_SEPARATOR);
+	if (md5 == NULL)
+	{
+		publishState(PAYLOAD_ERROR);
+		return;
+	}
+
+	*md5++ = CH_NONE;
+	size_t size = strtoul(_otaPayloadBuff, NULL, 10);
+
+	cancel();
+
+	// The MD5 is checked before the updater starts, a started updater blocks all next updates.
+	if (size == 0 || strlen(md5) != OTA_MD5_LEN)
+	{
+		publishState(PAYLOAD_ERROR);
+		return;
+	}
+
+	if (!Update.begin(size))
+	{
+		publishError();
+		return;
+	}
+
+	if (!Update.setMD5(md5))
+	{
+		Update.end(false);
+		publishState(PAYLOAD_ERROR);
+		return;
+	}
+
+	_size = size;
+	_startTime = millis();
+	_minFreeHeap = ESP.getFreeHeap();
+
+	DEBUG_FC_PRINT(F("OTA started. Size: "));
+	DEBUG_FC_PRINTLN(_size);
+
+	publishState(PAYLOAD_OTA_RECEIVING);
+}
+
+void FanCoilOtaClass::writeChunk(const char* offsetStr, byte* payload, unsigned int length)
+{
+	if (!isInProgress())
+	{
+		publishState(PAYLOAD_ERROR);
+		return;
+	}
+
+	char* endPtr;
+	size_t offset = strtoul(offsetStr, &endPtr, 10);
+
+	// Duplicated or lost chunk. Send the expected offset to resume from it.
+	if (*endPtr != CH_NONE || offset != _offset || _offset + length > _size)
+	{
+		publishState(PAYLOAD_OTA_RECEIVING);
+		return;
+	}
+
+	if (Update.write(payload, length) != length)
+	{
+		publishError();
+		cancel();
+		return;
+	}
+
+	_offset += length;
+
+	uint32_t freeHeap = ESP.getFreeHeap();
+	if (freeHeap < _minFreeHeap)
+	{
+		_minFreeHeap = freeHeap;
+	}
+
+	publishState(PAYLOAD_OTA_RECEIVING);
+}
+
+void FanCoilOtaClass::end()
+{
+	if (!isInProgress() || _offset != _size)
+	{
+		publishState(PAYLOAD_ERROR);
+		return;
+	}
+
+	// Checks MD5 and marks the new firmware to be copied by the boot loader on the next start.
+	if (!Update.end())
+	{
+		_size = 0;
+		publishError();
+		return;
+	}
+
+	// Report throughput in KB/s and the lowest free heap during the update.
+	unsigned long duration = millis() - _startTime;
+	uint32_t speed = duration == 0 ? 0 : _size / duration;
+
+	buildTopic(_otaTopicBuff, _baseTopic, TOPIC_OTA_STATE);
+	strcpy_P(_otaPayloadBuff, PAYLOAD_OTA_DONE);
+	size_t len = strlen(_otaPayloadBuff);
+	snprintf(_otaPayloadBuff + len, OTA_STATE_PAYLOAD_LEN - len, ";%u;%u;%u", _size, speed, _minFreeHeap);
+	_publish(_otaTopicBuff, _otaPayloadBuff);
+
+	_size = 0;
+	_restartTime = millis() + OTA_RESTART_DELAY_MS;
+}
+
+void FanCoilOtaClass::abort()
+{
+	if (isInProgress())
+	{
+		publishState(PAYLOAD_OFF);
+	}
+
+	cancel();
+}
+
+/**
+* @brief Stop the updater without a state message. The caller reports the reason.
+*
+* @return void
+**/
+void FanCoilOtaClass::cancel()
+{
+	if (isInProgress())
+	{
+		Update.end(false);
+	}
+
+	_size = 0;
+	_offset = 0;
+}
+
+/**
+* @brief Send the expected offset after MQTT reconnect. The sender continues from it.
+*
+* @return void
+**/
+void FanCoilOtaClass::publishResume()
+{
+	if (isInProgress())
+	{
+		publishState(PAYLOAD_OTA_RECEIVING);
+	}
+}
+
+/**
+* @brief Restart the device after a successful update. It is called from the main loop to allow the last message to be sent.
+*
+* @return void
+**/
+void FanCoilOtaClass::process()
+{
+	if (_restartTime != 0 && timeToDeadline(_restartTime) < 0)
+	{
+		DEBUG_FC_PRINTLN(F("OTA finished. Restarting..."));
+		ESP.restart();
+	}
+}
+
+void FanCoilOtaClass::publishState(PGM_P status)
+{
+	buildTopic(_otaTopicBuff, _baseTopic, TOPIC_OTA_STATE);
+	strcpy_P(_otaPayloadBuff, status);
+	size_t len = strlen(_otaPayloadBuff);
+	snprintf(_otaPayloadBuff + len, OTA_STATE_PAYLOAD_LEN - len, ";%u", _offset);
+
+	_publish(_otaTopicBuff, _otaPayloadBuff);
+}
+
+void FanCoilOtaClass::publishError()
+{
+	DEBUG_FC_PRINT(F("OTA error: "));
+#ifdef WIFIFCMM_DEBUG
+	Update.printError(DEBUG_FC);
+#endif
+
+	buildTopic(_otaTopicBuff, _baseTopic, TOPIC_OTA_STATE);
+	strcpy_P(_otaPayloadBuff, PAYLOAD_ERROR);
+	size_t len = strlen(_otaPayloadBuff);
+	snprintf(_otaPayloadBuff + len, OTA_STATE_PAYLOAD_LEN - len, ";%u", Update.getError());
+
+	_publish(_otaTopicBuff, _otaPayloadBuff);
+}
+
+FanCoilOtaClass FanCoilOta;
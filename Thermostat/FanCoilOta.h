@@ -0,0 +1,60 @@
+// FanCoilOta.h
+
+#ifndef _FANCOILOTA_h
+#define _FANCOILOTA_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+
+// Firmware update over MQTT. Images are not signed, so anyone who can publish to the base topic can flash the device.
+// Uncomment it only with a broker which restricts the base topic to trusted clients, better with MQTT over TLS.
+//#define OTA_MQTT
+// The biggest firmware chunk in one MQTT message. MQTT_BUFFER_SIZE should keep a chunk and its topic.
+#define OTA_MAX_CHUNK_LEN 1536
+// MD5 of the firmware in hex
+#define OTA_MD5_LEN 32
+#define OTA_STATE_PAYLOAD_LEN 48
+#define OTA_RESTART_DELAY_MS 1000
+
+typedef void(* callBackMqttPublish) (const char* topic, char* payload);
+
+/**
+* @brief Firmware update over MQTT. Chunks are written directly to the update partition.
+* Topics (after basetopic/):
+*   ota/begin: <size>;<md5> - start an update
+*   ota/chunk/<offset>: binary data - a next firmware chunk
+*   ota/end - check MD5 and apply the new firmware
+*   ota/abort - cancel the update
+* The device answers in basetopic/otastate: <status>;<next expected offset>.
+* After the end it sends: done;<size>;<speed KB/s>;<min free heap>.
+**/
+class FanCoilOtaClass
+{
+private:
+	const char* _baseTopic;
+	callBackMqttPublish _publish;
+	size_t _size = 0;
+	size_t _offset = 0;
+	unsigned long _startTime;
+	uint32_t _minFreeHeap;
+	unsigned long _restartTime = 0;
+
+	void begin(byte* payload, unsigned int length);
+	void writeChunk(const char* offsetStr, byte* payload, unsigned int length);
+	void end();
+	void abort();
+	void cancel();
+	void publishState(PGM_P status);
+	void publishError();
+public:
+	void init(const char* baseTopic, callBackMqttPublish publish);
+
+	bool isInProgress();
+	bool processTopic(char* topic, byte* payload, unsigned int length);
+	void publishResume();
+	void process();
+};
+
+extern FanCoilOtaClass FanCoilOta;
+
+#endif
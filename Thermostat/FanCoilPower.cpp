@@ -0,0 +1,79 @@
+//
+//
+//
+
+#include "FanCoilPower.h"
+
+/**
+* @brief Set the radio sleep type. WiFi should be in station mode.
+*
+* @return void
+*/
+void FanCoilPowerClass::init()
+{
+#ifdef POWER_SAVE
+	WiFi.setSleepMode(POWER_SLEEP_TYPE, POWER_LISTEN_INTERVAL);
+#endif
+	_wakeTime = millis();
+	_accountingTime = _wakeTime;
+}
+
+/**
+* @brief End of a loop. Count the awake time and sleep until the next work.
+* @param sleepMs Time until the next scheduled work. Without POWER_SAVE the loop does not sleep.
+*
+* @return bool true - the energy figures were recalculated.
+*/
+bool FanCoilPowerClass::idle(unsigned long sleepMs)
+{
+	unsigned long now = millis();
+	_awakeMs += now - _wakeTime;
+
+#ifdef POWER_SAVE
+	if (sleepMs > POWER_MAX_IDLE_MS)
+	{
+		sleepMs = POWER_MAX_IDLE_MS;
+	}
+
+	if (sleepMs > 0)
+	{
+		delay(sleepMs);
+	}
+#endif
+
+	_wakeTime = millis();
+	_sleepMs += _wakeTime - now;
+
+	if (_wakeTime - _accountingTime < POWER_ACCOUNTING_MS)
+	{
+		return false;
+	}
+
+	_accountingTime = _wakeTime;
+
+	uint64_t total = _awakeMs + _sleepMs;
+	if (total > 0)
+	{
+		_energyPerHour = (_awakeMs * POWER_AWAKE_MW + _sleepMs * POWER_SLEEP_MW) / total;
+		_sleepPercent = _sleepMs * 100 / total;
+	}
+
+	return true;
+}
+
+/**
+* @brief Estimated energy per hour from the awake and sleep time since start. Updated every POWER_ACCOUNTING_MS.
+*
+* @return uint32_t mWh per hour.
+*/
+uint32_t FanCoilPowerClass::energyPerHour()
+{
+	return _energyPerHour;
+}
+
+uint8_t FanCoilPowerClass::sleepPercent()
+{
+	return _sleepPercent;
+}
+
+FanCoilPowerClass FanCoilPower;
@@ -0,0 +1,51 @@
+// FanCoilPower.h
+
+#ifndef _FANCOILPOWER_h
+#define _FANCOILPOWER_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+#include <ESP8266WiFi.h>
+
+// Power save. The loop sleeps until the next scheduled work and the radio sleeps between beacons.
+// Comment it to keep the radio always on and the loop spinning.
+//#define POWER_SAVE
+// WIFI_LIGHT_SLEEP - the CPU sleeps too while the loop waits. WIFI_MODEM_SLEEP - only the radio sleeps.
+#define POWER_SLEEP_TYPE WIFI_LIGHT_SLEEP
+// The radio wakes every DTIM beacon * this to receive data.
+#define POWER_LISTEN_INTERVAL 3
+// The longest loop sleep. Received commands and HTTP requests wait at most this (plus the listen interval).
+// It is much shorter than MQTT keep alive (15 s), so pings are sent in time.
+#define POWER_MAX_IDLE_MS 100
+
+// Energy model of the ESP8266 module, mW at 3.3 V. Relays and the bypass valve are not included.
+// Awake: CPU running, radio on.
+#define POWER_AWAKE_MW 240
+// Sleeping in the loop: about 3 mA for light sleep with DTIM3 wakes, use 50 (15 mA) for modem sleep.
+#define POWER_SLEEP_MW 10
+// The energy figures are calculated once per this time.
+#define POWER_ACCOUNTING_MS 10000
+
+/**
+* @brief Power save between scheduled work and estimated energy from awake and sleep time.
+**/
+class FanCoilPowerClass
+{
+private:
+	unsigned long _wakeTime = 0;
+	uint64_t _awakeMs = 0;
+	uint64_t _sleepMs = 0;
+	unsigned long _accountingTime = 0;
+	uint32_t _energyPerHour = POWER_AWAKE_MW;
+	uint8_t _sleepPercent = 0;
+public:
+	void init();
+
+	bool idle(unsigned long sleepMs);
+	uint32_t energyPerHour();
+	uint8_t sleepPercent();
+};
+
+extern FanCoilPowerClass FanCoilPower;
+
+#endif
@@ -0,0 +1,146 @@
+//
+//
+//
+
+#include "FanCoilRemoteSensors.h"
+#include "KMPCommon.h"
+
+/**
+* @brief Fill the remote sensor list from settings.
+* @param settings RemoteSensors: "topic=weight;topic=weight".
+*
+* @return void
+**/
+void FanCoilRemoteSensorsClass::init(DeviceSettings* settings)
+{
+	_count = 0;
+	_localWeight = REMOTE_SENSOR_DEFAULT_WEIGHT;
+
+	const char* item = settings->RemoteSensors;
+	while (*item != CH_NONE)
+	{
+		const char* itemEnd = strchr(item, PAYLOAD_SEPARATOR);
+		size_t itemLen = itemEnd == NULL ? strlen(item) : itemEnd - item;
+
+		// Weight is after the last '=' in the item.
+		size_t topicLen = itemLen;
+		for (size_t i = 0; i < itemLen; i++)
+		{
+			if (item[i] == PAYLOAD_ASSIGN)
+			{
+				topicLen = i;
+			}
+		}
+
+		int32_t weight = REMOTE_SENSOR_DEFAULT_WEIGHT;
+		if (topicLen == itemLen
+			|| parseFixed(item + topicLen + 1, itemLen - topicLen - 1, REMOTE_SENSOR_PRECISION, 0, REMOTE_SENSOR_MAX_WEIGHT, &weight))
+		{
+			if (topicLen == strlen_P(REMOTE_SENSOR_LOCAL) && strncmp_P(item, REMOTE_SENSOR_LOCAL, topicLen) == 0)
+			{
+				_localWeight = weight;
+			}
+			else
+			{
+				add(item, topicLen, weight);
+			}
+		}
+
+		item += itemLen;
+		if (*item != CH_NONE)
+		{
+			item++;
+		}
+	}
+}
+
+void FanCoilRemoteSensorsClass::add(const char* topic, size_t topicLen, int32_t weight)
+{
+	if (_count >= REMOTE_SENSORS_MAX || topicLen == 0 || topicLen >= REMOTE_SENSOR_TOPIC_LEN)
+	{
+		return;
+	}
+
+	RemoteSensor* sensor = &_sensors[_count++];
+	memcpy(sensor->Topic, topic, topicLen);
+	sensor->Topic[topicLen] = CH_NONE;
+	sensor->Weight = weight;
+	sensor->HasValue = false;
+}
+
+uint8_t FanCoilRemoteSensorsClass::count()
+{
+	return _count;
+}
+
+const char* FanCoilRemoteSensorsClass::topic(uint8_t index)
+{
+	return _sensors[index].Topic;
+}
+
+/**
+* @brief Keep the value of a remote sensor topic.
+* @param topic Received topic.
+* @param payload Temperature, for example 23.45. Other payloads (N/A) are skipped.
+* @param length The payload length.
+*
+* @return bool true - it is a remote sensor topic.
+**/
+bool FanCoilRemoteSensorsClass::processTopic(const char* topic, const byte* payload, unsigned int length)
+{
+	for (uint8_t i = 0; i < _count; i++)
+	{
+		RemoteSensor* sensor = &_sensors[i];
+		if (strcmp(topic, sensor->Topic) == 0)
+		{
+			if (parseFixed((const char*)payload, length, REMOTE_SENSOR_PRECISION,
+				REMOTE_SENSOR_MIN_TEMPERATURE, REMOTE_SENSOR_MAX_TEMPERATURE, &sensor->Value))
+			{
+				sensor->UpdateTime = millis();
+				sensor->HasValue = true;
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+* @brief Room temperature: weighted average of the local and the fresh remote values.
+* @param local Local sensor value, NAN - the sensor does not exist.
+*
+* @return float The room temperature. It is the local value if there are no fresh remote values, NAN if there are no values.
+**/
+float FanCoilRemoteSensorsClass::fuse(float local)
+{
+	float sum = 0;
+	int32_t weights = 0;
+
+	if (!std::isnan(local) && _localWeight > 0)
+	{
+		sum = local * _localWeight;
+		weights = _localWeight;
+	}
+
+	unsigned long now = millis();
+	for (uint8_t i = 0; i < _count; i++)
+	{
+		RemoteSensor* sensor = &_sensors[i];
+		if (sensor->HasValue && now - sensor->UpdateTime < REMOTE_SENSOR_STALE_MS)
+		{
+			sum += (float)sensor->Value / POW10[REMOTE_SENSOR_PRECISION] * sensor->Weight;
+			weights += sensor->Weight;
+		}
+	}
+
+	if (weights == 0)
+	{
+		return local;
+	}
+
+	return sum / weights;
+}
+
+FanCoilRemoteSensorsClass FanCoilRemoteSensors;
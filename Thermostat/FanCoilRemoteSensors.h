@@ -0,0 +1,57 @@
+// FanCoilRemoteSensors.h
+
+#ifndef _FANCOILREMOTESENSORS_h
+#define _FANCOILREMOTESENSORS_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+
+#define REMOTE_SENSORS_MAX 4
+#define REMOTE_SENSOR_TOPIC_LEN 64
+// A remote value older than this is not used.
+#define REMOTE_SENSOR_STALE_MS 600000
+// Remote values and weights are parsed with this precision.
+#define REMOTE_SENSOR_PRECISION 2
+#define REMOTE_SENSOR_MIN_TEMPERATURE -5000
+#define REMOTE_SENSOR_MAX_TEMPERATURE 10000
+#define REMOTE_SENSOR_MAX_WEIGHT 10000
+// Weight 1.0 of the local sensor and of an item without a weight
+#define REMOTE_SENSOR_DEFAULT_WEIGHT 100
+
+struct RemoteSensor
+{
+	char Topic[REMOTE_SENSOR_TOPIC_LEN];
+	// Weight in fixed point, REMOTE_SENSOR_PRECISION digits
+	int32_t Weight;
+	// Last received temperature in fixed point, REMOTE_SENSOR_PRECISION digits
+	int32_t Value;
+	unsigned long UpdateTime;
+	bool HasValue;
+};
+
+/**
+* @brief Room temperature from the local sensor and temperature topics of other devices (another thermostat, a wireless sensor bridge).
+* Settings RemoteSensors: "topic=weight;topic=weight". The item "local=weight" sets the local sensor weight (default 1).
+* The room temperature is the weighted average of the local value and remote values received in the last REMOTE_SENSOR_STALE_MS.
+* Topics and values are kept in fixed buffers, received payloads are parsed in place.
+**/
+class FanCoilRemoteSensorsClass
+{
+private:
+	RemoteSensor _sensors[REMOTE_SENSORS_MAX];
+	uint8_t _count = 0;
+	int32_t _localWeight = REMOTE_SENSOR_DEFAULT_WEIGHT;
+
+	void add(const char* topic, size_t topicLen, int32_t weight);
+public:
+	void init(DeviceSettings* settings);
+
+	uint8_t count();
+	const char* topic(uint8_t index);
+	bool processTopic(const char* topic, const byte* payload, unsigned int length);
+	float fuse(float local);
+};
+
+extern FanCoilRemoteSensorsClass FanCoilRemoteSensors;
+
+#endif
@@ -0,0 +1,189 @@
+//
+//
+//
+
+#include "FanCoilRuntime.h"
+#include <ArduinoJson.h>
+#include <FS.h>
+
+/**
+* @brief Read counters saved to the flash. SPIFFS should be mounted.
+*
+* @return bool true - counters are read.
+*/
+bool FanCoilRuntimeClass::load()
+{
+	if (!SPIFFS.exists(FPSTR(RUNTIME_FILE_NAME)))
+	{
+		return false;
+	}
+
+	File file = SPIFFS.open(FPSTR(RUNTIME_FILE_NAME), "r");
+	if (!file)
+	{
+		return false;
+	}
+
+	StaticJsonDocument<256> json;
+	DeserializationError error = deserializeJson(json, file);
+	file.close();
+
+	if (error)
+	{
+		DEBUG_FC_PRINTLN(F("Runtime counters are not valid."));
+		return false;
+	}
+
+	JsonArray degrees = json[FPSTR(RUNTIME_FAN_DEGREE_KEY)];
+	for (uint8_t i = 0; i < RUNTIME_DEGREES_LEN; i++)
+	{
+		_counters.DegreeSeconds[i] = degrees[i].as<uint32_t>();
+	}
+
+	_counters.BypassOnSeconds = json[FPSTR(RUNTIME_BYPASS_ON_KEY)].as<uint32_t>();
+	_counters.HeatWh = json[FPSTR(RUNTIME_HEAT_WH_KEY)].as<uint32_t>();
+	_counters.CoolWh = json[FPSTR(RUNTIME_COOL_WH_KEY)].as<uint32_t>();
+	_counters.HeatJ = json[FPSTR(RUNTIME_HEAT_J_KEY)].as<uint16_t>();
+	_counters.CoolJ = json[FPSTR(RUNTIME_COOL_J_KEY)].as<uint16_t>();
+
+	return true;
+}
+
+/**
+* @brief Save counters to the flash.
+*
+* @return void
+*/
+void FanCoilRuntimeClass::save()
+{
+	File file = SPIFFS.open(FPSTR(RUNTIME_FILE_NAME), "w");
+	if (!file)
+	{
+		DEBUG_FC_PRINTLN(F("Failed to open a runtime file for writing."));
+		return;
+	}
+
+	write(file);
+	file.close();
+}
+
+/**
+* @brief Continue with counters from the warm start snapshot. They are newer than saved in the flash.
+* @param counters Restored counters.
+*
+* @return void
+*/
+void FanCoilRuntimeClass::restore(const RuntimeCounters* counters)
+{
+	_counters = *counters;
+}
+
+const RuntimeCounters* FanCoilRuntimeClass::counters()
+{
+	return &_counters;
+}
+
+void FanCoilRuntimeClass::addEnergy(uint32_t* wh, uint16_t* joules, uint32_t value)
+{
+	value += *joules;
+	*wh += value / JOULES_IN_WH;
+	*joules = value % JOULES_IN_WH;
+}
+
+/**
+* @brief Count elapsed seconds for the current fan degree and bypass state, and the thermal energy.
+* @param fanDegree Current fan degree.
+* @param isBypassOn Bypass state is On.
+* @param mode Current mode. Energy is counted as heat or cool.
+* @param pipeDiffTemp Inlet pipe and room temperature difference in the mode direction. NAN - inlet sensor does not exist.
+*
+* @return RuntimeEvent RuntimeNone - nothing is changed. RuntimeTick - counters are increased.
+* RuntimeCheckpoint - counters are saved too, time to publish them.
+*/
+RuntimeEvent FanCoilRuntimeClass::process(uint8_t fanDegree, bool isBypassOn, Mode mode, float pipeDiffTemp)
+{
+	unsigned long elapsed = millis() - _tickTime;
+	if (elapsed < RUNTIME_TICK_MS)
+	{
+		return RuntimeNone;
+	}
+
+	uint32_t seconds = elapsed / RUNTIME_TICK_MS;
+	// The rest of a second is counted in the next tick.
+	_tickTime += seconds * RUNTIME_TICK_MS;
+
+	if (fanDegree < RUNTIME_DEGREES_LEN)
+	{
+		_counters.DegreeSeconds[fanDegree] += seconds;
+
+		if (!std::isnan(pipeDiffTemp) && pipeDiffTemp > 0)
+		{
+			uint32_t joules = RUNTIME_COIL_W_PER_C[fanDegree] * pipeDiffTemp * seconds;
+			if (mode == Heat)
+			{
+				addEnergy(&_counters.HeatWh, &_counters.HeatJ, joules);
+			}
+			else
+			{
+				addEnergy(&_counters.CoolWh, &_counters.CoolJ, joules);
+			}
+		}
+	}
+
+	if (isBypassOn)
+	{
+		_counters.BypassOnSeconds += seconds;
+	}
+
+	// Elapsed time works over millis() rollover.
+	if (millis() - _checkpointTime < RUNTIME_CHECKPOINT_MS)
+	{
+		return RuntimeTick;
+	}
+
+	_checkpointTime = millis();
+	save();
+
+	return RuntimeCheckpoint;
+}
+
+/**
+* @brief Write counters as JSON. It is the published payload and the saved file.
+* @param out Where to write.
+*
+* @return void
+*/
+void FanCoilRuntimeClass::write(Print& out)
+{
+	out.print(F("{\""));
+	out.print(FPSTR(RUNTIME_FAN_DEGREE_KEY));
+	out.print(F("\":["));
+	for (uint8_t i = 0; i < RUNTIME_DEGREES_LEN; i++)
+	{
+		if (i > 0)
+		{
+			out.print(',');
+		}
+
+		out.print(_counters.DegreeSeconds[i]);
+	}
+	out.print(']');
+
+	writeCounter(out, RUNTIME_BYPASS_ON_KEY, _counters.BypassOnSeconds);
+	writeCounter(out, RUNTIME_HEAT_WH_KEY, _counters.HeatWh);
+	writeCounter(out, RUNTIME_COOL_WH_KEY, _counters.CoolWh);
+	writeCounter(out, RUNTIME_HEAT_J_KEY, _counters.HeatJ);
+	writeCounter(out, RUNTIME_COOL_J_KEY, _counters.CoolJ);
+
+	out.print('}');
+}
+
+void FanCoilRuntimeClass::writeCounter(Print& out, PGM_P name, uint32_t value)
+{
+	out.print(F(",\""));
+	out.print(FPSTR(name));
+	out.print(F("\":"));
+	out.print(value);
+}
+
+FanCoilRuntimeClass FanCoilRuntime;
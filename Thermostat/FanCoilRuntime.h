@@ -0,0 +1,71 @@
+// FanCoilRuntime.h
+
+#ifndef _FANCOILRUNTIME_h
+#define _FANCOILRUNTIME_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+
+#define RUNTIME_TICK_MS 1000
+// Counters are saved to the flash and published once per hour.
+#define RUNTIME_CHECKPOINT_MS 3600000
+#define RUNTIME_DEGREES_LEN (FAN_SWITCH_LEVEL_LEN + 1)
+#define JOULES_IN_WH 3600
+
+// Heat transfer of the fan coil, W per °C of the inlet pipe and room difference, at every fan degree.
+// Nominal values, calibrate them for the fan coil model.
+const uint16_t RUNTIME_COIL_W_PER_C[RUNTIME_DEGREES_LEN] = { 0, 25, 40, 55 };
+
+/**
+* @brief Accumulated counters. There are no padding bytes, they are kept in the warm start snapshot too.
+*/
+struct RuntimeCounters
+{
+	// Seconds at every fan degree, 0 - the fan is stopped
+	uint32_t DegreeSeconds[RUNTIME_DEGREES_LEN];
+	// Seconds with bypass state On
+	uint32_t BypassOnSeconds;
+	// Estimated thermal energy: Wh and the rest in J
+	uint32_t HeatWh;
+	uint32_t CoolWh;
+	uint16_t HeatJ;
+	uint16_t CoolJ;
+};
+
+enum RuntimeEvent
+{
+	// Less than a tick elapsed, counters are not changed
+	RuntimeNone = 0,
+	// Counters are increased
+	RuntimeTick = 1,
+	// Counters are increased and saved, time to publish them
+	RuntimeCheckpoint = 2
+};
+
+/**
+* @brief Runtime and energy accounting. Counters are increased in RAM once per second, saved to /runtime.json
+* and published once per hour.
+**/
+class FanCoilRuntimeClass
+{
+private:
+	RuntimeCounters _counters = {};
+	unsigned long _tickTime = 0;
+	// Time of the last checkpoint
+	unsigned long _checkpointTime = 0;
+
+	void addEnergy(uint32_t* wh, uint16_t* joules, uint32_t value);
+	void writeCounter(Print& out, PGM_P name, uint32_t value);
+public:
+	bool load();
+	void save();
+	void restore(const RuntimeCounters* counters);
+	const RuntimeCounters* counters();
+
+	RuntimeEvent process(uint8_t fanDegree, bool isBypassOn, Mode mode, float pipeDiffTemp);
+	void write(Print& out);
+};
+
+extern FanCoilRuntimeClass FanCoilRuntime;
+
+#endif
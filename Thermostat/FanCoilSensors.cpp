@@ -0,0 +1,253 @@
+//
+//
+//
+
+#include "FanCoilSensors.h"
+
+#if defined(CLIMATE_SENSOR_SHT3X) || defined(CLIMATE_SENSOR_BME280)
+/**
+* @brief Start I2C on the Grove port.
+*
+* @return void
+*/
+void beginI2C()
+{
+	Wire.begin(I2C_SDA_PIN, I2C_SCL_PIN);
+	Wire.setClock(I2C_CLOCK_HZ);
+}
+#endif
+
+#if defined(CLIMATE_SENSOR_SHT3X)
+
+#define SHT3X_SOFT_RESET 0x30A2
+// Periodic mode, 1 measurement per second, high repeatability
+#define SHT3X_PERIODIC_1MPS_HIGH 0x2130
+#define SHT3X_FETCH_DATA 0xE000
+#define SHT3X_RESET_TIME_MS 2
+
+/**
+* @brief SHT3x CRC-8: polynomial 0x31, initialization 0xFF.
+*
+* @return uint8_t The CRC of 2 bytes.
+*/
+uint8_t sht3xCrc(const uint8_t* data)
+{
+	uint8_t crc = 0xFF;
+
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		crc ^= data[i];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 0x80 ? (crc << 1) ^ 0x31 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+bool Sht3xSensor::command(uint16_t cmd)
+{
+	Wire.beginTransmission(SHT3X_ADDRESS);
+	Wire.write(cmd >> 8);
+	Wire.write(cmd & 0xFF);
+
+	return Wire.endTransmission() == 0;
+}
+
+bool Sht3xSensor::beginSensor()
+{
+	beginI2C();
+
+	if (!command(SHT3X_SOFT_RESET))
+	{
+		return false;
+	}
+
+	delay(SHT3X_RESET_TIME_MS);
+
+	return command(SHT3X_PERIODIC_1MPS_HIGH);
+}
+
+bool Sht3xSensor::readSensor(float& temperature, float& humidity)
+{
+	// The sensor may be connected after start. Periodic mode is started again if it does not respond.
+	if (!command(SHT3X_FETCH_DATA))
+	{
+		command(SHT3X_PERIODIC_1MPS_HIGH);
+		return false;
+	}
+
+	uint8_t data[6];
+	if (Wire.requestFrom((uint8_t)SHT3X_ADDRESS, (uint8_t)6) != 6)
+	{
+		// No new measurement yet
+		return !std::isnan(temperature);
+	}
+
+	for (uint8_t i = 0; i < 6; i++)
+	{
+		data[i] = Wire.read();
+	}
+
+	if (sht3xCrc(data) != data[2] || sht3xCrc(data + 3) != data[5])
+	{
+		return false;
+	}
+
+	uint16_t rawTemperature = (data[0] << 8) | data[1];
+	uint16_t rawHumidity = (data[3] << 8) | data[4];
+
+	temperature = -45.0 + 175.0 * rawTemperature / 65535.0;
+	humidity = 100.0 * rawHumidity / 65535.0;
+
+	return true;
+}
+
+#elif defined(CLIMATE_SENSOR_BME280)
+
+#define BME280_CHIP_ID 0x60
+#define BME280_REG_CHIP_ID 0xD0
+#define BME280_REG_CALIB_T 0x88
+#define BME280_REG_CALIB_H1 0xA1
+#define BME280_REG_CALIB_H2 0xE1
+#define BME280_REG_CTRL_HUM 0xF2
+#define BME280_REG_CTRL_MEAS 0xF4
+#define BME280_REG_CONFIG 0xF5
+#define BME280_REG_TEMP 0xFA
+// Humidity oversampling x1
+#define BME280_CTRL_HUM 0x01
+// Temperature oversampling x1, pressure skipped, normal mode
+#define BME280_CTRL_MEAS 0x23
+// Standby 1000 ms, filter off
+#define BME280_CONFIG 0xA0
+// Temperature value when the measurement is skipped or not ready
+#define BME280_TEMP_SKIPPED 0x80000
+
+bool Bme280Sensor::writeRegister(uint8_t reg, uint8_t value)
+{
+	Wire.beginTransmission(BME280_ADDRESS);
+	Wire.write(reg);
+	Wire.write(value);
+
+	return Wire.endTransmission() == 0;
+}
+
+bool Bme280Sensor::readRegisters(uint8_t reg, uint8_t* buffer, uint8_t length)
+{
+	Wire.beginTransmission(BME280_ADDRESS);
+	Wire.write(reg);
+	if (Wire.endTransmission() != 0 || Wire.requestFrom((uint8_t)BME280_ADDRESS, length) != length)
+	{
+		return false;
+	}
+
+	for (uint8_t i = 0; i < length; i++)
+	{
+		buffer[i] = Wire.read();
+	}
+
+	return true;
+}
+
+bool Bme280Sensor::beginSensor()
+{
+	beginI2C();
+
+	uint8_t data[7];
+	if (!readRegisters(BME280_REG_CHIP_ID, data, 1) || data[0] != BME280_CHIP_ID)
+	{
+		return false;
+	}
+
+	// Calibration data, datasheet 4.2.2
+	if (!readRegisters(BME280_REG_CALIB_T, data, 6))
+	{
+		return false;
+	}
+
+	_t1 = data[0] | (data[1] << 8);
+	_t2 = data[2] | (data[3] << 8);
+	_t3 = data[4] | (data[5] << 8);
+
+	if (!readRegisters(BME280_REG_CALIB_H1, &_h1, 1) || !readRegisters(BME280_REG_CALIB_H2, data, 7))
+	{
+		return false;
+	}
+
+	_h2 = data[0] | (data[1] << 8);
+	_h3 = data[2];
+	// 12 bits signed values
+	_h4 = (int8_t)data[3] * 16 | (data[4] & 0x0F);
+	_h5 = (int8_t)data[5] * 16 | (data[4] >> 4);
+	_h6 = data[6];
+
+	// ctrl_hum is applied after writing ctrl_meas.
+	return writeRegister(BME280_REG_CTRL_HUM, BME280_CTRL_HUM)
+		&& writeRegister(BME280_REG_CONFIG, BME280_CONFIG)
+		&& writeRegister(BME280_REG_CTRL_MEAS, BME280_CTRL_MEAS);
+}
+
+bool Bme280Sensor::readSensor(float& temperature, float& humidity)
+{
+	// Temperature 0xFA-0xFC, humidity 0xFD-0xFE. They are read together to get the same measurement.
+	uint8_t data[5];
+	if (!readRegisters(BME280_REG_TEMP, data, 5))
+	{
+		return false;
+	}
+
+	int32_t adcT = ((uint32_t)data[0] << 12) | ((uint32_t)data[1] << 4) | (data[2] >> 4);
+	int32_t adcH = ((uint32_t)data[3] << 8) | data[4];
+
+	if (adcT == BME280_TEMP_SKIPPED)
+	{
+		// The sensor was reset. Configure it again.
+		beginSensor();
+		return false;
+	}
+
+	// Compensation formulas, datasheet 4.2.3. Temperature in 0.01 °C, humidity in 1/1024 %RH.
+	int32_t var1 = ((((adcT >> 3) - ((int32_t)_t1 << 1))) * ((int32_t)_t2)) >> 11;
+	int32_t var2 = (((((adcT >> 4) - ((int32_t)_t1)) * ((adcT >> 4) - ((int32_t)_t1))) >> 12) * ((int32_t)_t3)) >> 14;
+	int32_t tFine = var1 + var2;
+
+	int32_t t = (tFine * 5 + 128) >> 8;
+
+	int32_t h = tFine - ((int32_t)76800);
+	h = (((((adcH << 14) - (((int32_t)_h4) << 20) - (((int32_t)_h5) * h)) + ((int32_t)16384)) >> 15)
+		* (((((((h * ((int32_t)_h6)) >> 10) * (((h * ((int32_t)_h3)) >> 11) + ((int32_t)32768))) >> 10)
+		+ ((int32_t)2097152)) * ((int32_t)_h2) + 8192) >> 14));
+	h = h - (((((h >> 15) * (h >> 15)) >> 7) * ((int32_t)_h1)) >> 4);
+	h = h < 0 ? 0 : h;
+	h = h > 419430400 ? 419430400 : h;
+
+	temperature = t / 100.0;
+	humidity = (h >> 12) / 1024.0;
+
+	return true;
+}
+
+#else
+
+bool DhtSensor::beginSensor()
+{
+	_dht.begin();
+
+	return true;
+}
+
+bool DhtSensor::readSensor(float& temperature, float& humidity)
+{
+	if (!_dht.read())
+	{
+		return false;
+	}
+
+	temperature = _dht.readTemperature();
+	humidity = _dht.readHumidity();
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,149 @@
+// FanCoilSensors.h
+
+#ifndef _FANCOILSENSORS_h
+#define _FANCOILSENSORS_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+
+#if defined(CLIMATE_SENSOR_SHT3X) || defined(CLIMATE_SENSOR_BME280)
+#include <Wire.h>
+#else
+#include <DHT.h>                  // Install with Library Manager. "DHT sensor library by Adafruit" https://github.com/adafruit/DHT-sensor-library
+#endif
+
+// DHT22 can not be read more often. The library returns the last result before it.
+#define DHT_MIN_INTERVAL_MS 2000
+// SHT3x measures in periodic mode 1 time per second. Fetching data does not wait for a measurement.
+#define SHT3X_MIN_INTERVAL_MS 1000
+#define SHT3X_ADDRESS 0x44
+// BME280 measures in normal mode every 1000 ms (standby time).
+#define BME280_MIN_INTERVAL_MS 1000
+#define BME280_ADDRESS 0x76
+
+/**
+* @brief Temperature and humidity sensor. Drivers derive from it (CRTP) and implement beginSensor() and readSensor(),
+* so the calls are resolved at compile time without virtual functions.
+* A read is done once per driver MIN_INTERVAL_MS, between them the last result is returned.
+*/
+template <class TDriver>
+class ClimateSensor
+{
+private:
+	unsigned long _readTime = 0;
+	bool _isRead = false;
+	bool _result = false;
+	float _temperature = NAN;
+	float _humidity = NAN;
+	// Duration of the last real read in us
+	uint32_t _readDuration = 0;
+
+	TDriver& driver() { return *static_cast<TDriver*>(this); }
+public:
+	bool begin()
+	{
+		return driver().beginSensor();
+	}
+
+	/**
+	* @brief Read temperature and humidity.
+	* @param temperature Result in °C.
+	* @param humidity Result in %RH.
+	*
+	* @return bool true - the sensor responds and the values are valid.
+	*/
+	bool read(float& temperature, float& humidity)
+	{
+		if (!_isRead || millis() - _readTime >= TDriver::MIN_INTERVAL_MS)
+		{
+			unsigned long start = micros();
+			_result = driver().readSensor(_temperature, _humidity);
+			_readDuration = micros() - start;
+			_readTime = millis();
+			_isRead = true;
+		}
+
+		temperature = _temperature;
+		humidity = _humidity;
+
+		return _result;
+	}
+
+	uint32_t readDuration()
+	{
+		return _readDuration;
+	}
+};
+
+#if defined(CLIMATE_SENSOR_SHT3X)
+
+/**
+* @brief Sensirion SHT3x over I2C. The sensor measures in periodic mode, a read only fetches the last measurement.
+* Interrupts stay enabled.
+*/
+class Sht3xSensor : public ClimateSensor<Sht3xSensor>
+{
+private:
+	bool command(uint16_t cmd);
+public:
+	static const uint32_t MIN_INTERVAL_MS = SHT3X_MIN_INTERVAL_MS;
+
+	bool beginSensor();
+	bool readSensor(float& temperature, float& humidity);
+};
+
+typedef Sht3xSensor ClimateSensorDriver;
+
+#elif defined(CLIMATE_SENSOR_BME280)
+
+/**
+* @brief Bosch BME280 over I2C. The sensor measures in normal mode, a read only gets the last measurement registers.
+* Pressure is not measured. Interrupts stay enabled.
+*/
+class Bme280Sensor : public ClimateSensor<Bme280Sensor>
+{
+private:
+	uint16_t _t1;
+	int16_t _t2;
+	int16_t _t3;
+	uint8_t _h1;
+	int16_t _h2;
+	uint8_t _h3;
+	int16_t _h4;
+	int16_t _h5;
+	int8_t _h6;
+
+	bool writeRegister(uint8_t reg, uint8_t value);
+	bool readRegisters(uint8_t reg, uint8_t* buffer, uint8_t length);
+public:
+	static const uint32_t MIN_INTERVAL_MS = BME280_MIN_INTERVAL_MS;
+
+	bool beginSensor();
+	bool readSensor(float& temperature, float& humidity);
+};
+
+typedef Bme280Sensor ClimateSensorDriver;
+
+#else
+
+/**
+* @brief DHT22 on one wire bit-banged protocol. The library disables interrupts for about 5 ms on every read.
+*/
+class DhtSensor : public ClimateSensor<DhtSensor>
+{
+private:
+	DHT _dht;
+public:
+	DhtSensor() : _dht(DHT_SENSORS_PIN, DHT_SENSORS_TYPE, 11) {}
+
+	static const uint32_t MIN_INTERVAL_MS = DHT_MIN_INTERVAL_MS;
+
+	bool beginSensor();
+	bool readSensor(float& temperature, float& humidity);
+};
+
+typedef DhtSensor ClimateSensorDriver;
+
+#endif
+
+#endif
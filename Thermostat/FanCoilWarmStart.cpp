@@ -0,0 +1,95 @@
+//
+//
+//
+
+#include "FanCoilWarmStart.h"
+#include <coredecls.h>
+
+static_assert(sizeof(WarmState) <= WARM_START_RTC_SIZE, "The snapshot does not fit in RTC user memory");
+static_assert(HUMIDITY_ARRAY_LEN <= WARM_START_COLLECTION_LEN && INLET_ARRAY_LEN <= WARM_START_COLLECTION_LEN,
+	"WARM_START_COLLECTION_LEN should be the longest averaging array");
+
+SensorData* const _warmChannels[WARM_START_CHANNELS_LEN] = { &TemperatureData, &HumidityData, &InletData };
+
+uint32_t warmStateCrc(const WarmState* state)
+{
+	return crc32((const uint8_t*)state + sizeof(state->Crc), sizeof(WarmState) - sizeof(state->Crc));
+}
+
+/**
+* @brief Restore sensor channels from the snapshot.
+* @param control Restored control state.
+*
+* @return bool true - the snapshot is valid and the channels are restored. false - cold start, nothing is changed.
+*/
+bool FanCoilWarmStartClass::restore(WarmControl* control)
+{
+	// After power on RTC memory keeps random data.
+	if (ESP.getResetInfoPtr()->reason == REASON_DEFAULT_RST)
+	{
+		return false;
+	}
+
+	WarmState state;
+	if (!ESP.rtcUserMemoryRead(WARM_START_RTC_OFFSET, (uint32_t*)&state, sizeof(WarmState))
+		|| state.Magic != WARM_START_MAGIC
+		|| state.Crc != warmStateCrc(&state))
+	{
+		return false;
+	}
+
+	for (uint8_t i = 0; i < WARM_START_CHANNELS_LEN; i++)
+	{
+		SensorData* data = _warmChannels[i];
+		WarmChannel* channel = &state.Channels[i];
+
+		memcpy(data->DataCollection, channel->DataCollection, data->DataCollectionLen * sizeof(float));
+		data->Current = channel->Current;
+		data->Average = channel->Average;
+		data->Slope = channel->Slope;
+		data->SampleIntervalMS = channel->SampleIntervalMS;
+		data->CurrentCollectPos = channel->CurrentCollectPos;
+		data->IsExists = channel->IsExists;
+	}
+
+	*control = state.Control;
+	FanCoilRuntime.restore(&state.Runtime);
+
+	return true;
+}
+
+/**
+* @brief Save sensor channels and the control state to the snapshot.
+* @param control Current control state.
+*
+* @return void
+*/
+void FanCoilWarmStartClass::save(const WarmControl* control)
+{
+	WarmState state;
+	memset(&state, 0, sizeof(WarmState));
+
+	state.Magic = WARM_START_MAGIC;
+
+	for (uint8_t i = 0; i < WARM_START_CHANNELS_LEN; i++)
+	{
+		SensorData* data = _warmChannels[i];
+		WarmChannel* channel = &state.Channels[i];
+
+		memcpy(channel->DataCollection, data->DataCollection, data->DataCollectionLen * sizeof(float));
+		channel->Current = data->Current;
+		channel->Average = data->Average;
+		channel->Slope = data->Slope;
+		channel->SampleIntervalMS = data->SampleIntervalMS;
+		channel->CurrentCollectPos = data->CurrentCollectPos;
+		channel->IsExists = data->IsExists;
+	}
+
+	state.Control = *control;
+	state.Runtime = *FanCoilRuntime.counters();
+	state.Crc = warmStateCrc(&state);
+
+	ESP.rtcUserMemoryWrite(WARM_START_RTC_OFFSET, (uint32_t*)&state, sizeof(WarmState));
+}
+
+FanCoilWarmStartClass FanCoilWarmStart;
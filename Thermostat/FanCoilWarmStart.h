@@ -0,0 +1,76 @@
+// FanCoilWarmStart.h
+
+#ifndef _FANCOILWARMSTART_h
+#define _FANCOILWARMSTART_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+#include "FanCoilRuntime.h"
+
+// RTC user memory offset in 4 bytes blocks. The first 128 bytes are used by eboot for OTA commands.
+#define WARM_START_RTC_OFFSET 32
+#define WARM_START_RTC_SIZE 384
+// Snapshot identifier. Change the last byte (version) if the snapshot layout is changed.
+#define WARM_START_MAGIC 0x46435703
+#define WARM_START_CHANNELS_LEN 3
+// The longest averaging array of all channels
+#define WARM_START_COLLECTION_LEN TEMPERATURE_ARRAY_LEN
+
+/**
+* @brief Sensor channel in the snapshot. There are no padding bytes, so the CRC does not depend on them.
+*/
+struct WarmChannel
+{
+	float DataCollection[WARM_START_COLLECTION_LEN];
+	float Current;
+	float Average;
+	float Slope;
+	uint32_t SampleIntervalMS;
+	uint8_t CurrentCollectPos;
+	uint8_t IsExists;
+	uint8_t Reserved[2];
+};
+
+/**
+* @brief Control state in the snapshot. Filled and applied by the sketch.
+*/
+struct WarmControl
+{
+	float DesiredTemperature;
+	uint8_t FanDegree;
+	uint8_t Mode;
+	uint8_t DeviceState;
+	uint8_t LastDeviceState;
+	uint8_t BypassState;
+	// The bypass state which was being set when the snapshot was saved
+	uint8_t BypassTarget;
+	uint8_t MaxHumidity;
+	uint8_t Reserved;
+};
+
+struct WarmState
+{
+	// CRC32 of all following data
+	uint32_t Crc;
+	uint32_t Magic;
+	WarmChannel Channels[WARM_START_CHANNELS_LEN];
+	WarmControl Control;
+	RuntimeCounters Runtime;
+};
+
+/**
+* @brief Snapshot of sensor averaging windows and control state in RTC user memory.
+* RTC memory survives software, watchdog, exception and external resets, so after them the device
+* continues with the same averages, fan degree and bypass state instead of starting from the first reading.
+* Runtime counters are kept too, so the time after the last flash checkpoint is not lost.
+**/
+class FanCoilWarmStartClass
+{
+public:
+	bool restore(WarmControl* control);
+	void save(const WarmControl* control);
+};
+
+extern FanCoilWarmStartClass FanCoilWarmStart;
+
+#endif
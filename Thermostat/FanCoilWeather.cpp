@@ -0,0 +1,199 @@
+//
+//
+//
+
+#include "FanCoilWeather.h"
+#include "KMPCommon.h"
+
+static_assert(WEATHER_HEAT_CURVE_LEN <= WEATHER_CURVE_MAX && WEATHER_COLD_CURVE_LEN <= WEATHER_CURVE_MAX,
+	"WEATHER_CURVE_MAX should keep the default curves");
+
+/**
+* @brief Set the outdoor temperature topic and the curves.
+* @param settings OutdoorTopic. Empty - weather compensation is off. HeatCurve and ColdCurve: "outdoor=offset;outdoor=offset".
+*
+* @return void
+**/
+void FanCoilWeatherClass::init(DeviceSettings* settings)
+{
+	_topic = settings->OutdoorTopic;
+	_hasValue = false;
+
+	_heatCurveLen = loadCurve(settings->HeatCurve, WEATHER_HEAT_CURVE, WEATHER_HEAT_CURVE_LEN, _heatCurve);
+	_coldCurveLen = loadCurve(settings->ColdCurve, WEATHER_COLD_CURVE, WEATHER_COLD_CURVE_LEN, _coldCurve);
+}
+
+/**
+* @brief Fill a curve from settings. An empty or not valid setting gives the default curve.
+* @param text The setting.
+* @param defaultCurve The default curve.
+* @param defaultLen The default curve length.
+* @param curve Result, WEATHER_CURVE_MAX points.
+*
+* @return uint8_t The curve length.
+**/
+uint8_t FanCoilWeatherClass::loadCurve(const char* text, const CurvePoint* defaultCurve, uint8_t defaultLen, CurvePoint* curve)
+{
+	uint8_t curveLen = *text == CH_NONE ? 0 : parseCurve(text, curve);
+	if (curveLen > 0)
+	{
+		return curveLen;
+	}
+
+	if (*text != CH_NONE)
+	{
+		DEBUG_FC_PRINT(F("Error: weather curve is not valid: "));
+		DEBUG_FC_PRINTLN(text);
+	}
+
+	memcpy(curve, defaultCurve, defaultLen * sizeof(CurvePoint));
+
+	return defaultLen;
+}
+
+/**
+* @brief Parse a curve "outdoor=offset;outdoor=offset", °C. Outdoor temperatures should be ascending.
+* @param text The curve.
+* @param curve Result, WEATHER_CURVE_MAX points.
+*
+* @return uint8_t The curve length, 0 - the curve is not valid.
+**/
+uint8_t FanCoilWeatherClass::parseCurve(const char* text, CurvePoint* curve)
+{
+	uint8_t curveLen = 0;
+
+	const char* item = text;
+	while (*item != CH_NONE)
+	{
+		const char* itemEnd = strchr(item, PAYLOAD_SEPARATOR);
+		size_t itemLen = itemEnd == NULL ? strlen(item) : itemEnd - item;
+
+		const char* assign = (const char*)memchr(item, PAYLOAD_ASSIGN, itemLen);
+		if (assign == NULL || curveLen >= WEATHER_CURVE_MAX)
+		{
+			return 0;
+		}
+
+		int32_t outdoor;
+		int32_t offset;
+		if (!parseFixed(item, assign - item, WEATHER_PRECISION, WEATHER_MIN_TEMPERATURE, WEATHER_MAX_TEMPERATURE, &outdoor)
+			|| !parseFixed(assign + 1, item + itemLen - assign - 1, WEATHER_PRECISION, WEATHER_MIN_OFFSET, WEATHER_MAX_OFFSET, &offset)
+			|| (curveLen > 0 && outdoor <= curve[curveLen - 1].Outdoor))
+		{
+			return 0;
+		}
+
+		curve[curveLen].Outdoor = outdoor;
+		curve[curveLen].Offset = offset;
+		curveLen++;
+
+		item += itemLen;
+		if (*item != CH_NONE)
+		{
+			item++;
+		}
+	}
+
+	return curveLen;
+}
+
+/**
+* @brief The outdoor temperature topic.
+*
+* @return const char* The topic, NULL - weather compensation is off.
+**/
+const char* FanCoilWeatherClass::topic()
+{
+	return *_topic == CH_NONE ? NULL : _topic;
+}
+
+/**
+* @brief Keep the outdoor temperature and calculate offsets for it.
+* @param topic Received topic.
+* @param payload Temperature, for example -7.5. Other payloads (N/A) are skipped.
+* @param length The payload length.
+*
+* @return bool true - it is the outdoor temperature topic.
+**/
+bool FanCoilWeatherClass::processTopic(const char* topic, const byte* payload, unsigned int length)
+{
+	if (*_topic == CH_NONE || strcmp(topic, _topic) != 0)
+	{
+		return false;
+	}
+
+	int32_t outdoor;
+	if (parseFixed((const char*)payload, length, WEATHER_PRECISION, WEATHER_MIN_TEMPERATURE, WEATHER_MAX_TEMPERATURE, &outdoor))
+	{
+		if (!_hasValue || outdoor != _outdoor)
+		{
+			_outdoor = outdoor;
+			_heatOffset = evaluate(_heatCurve, _heatCurveLen, outdoor);
+			_coldOffset = evaluate(_coldCurve, _coldCurveLen, outdoor);
+		}
+
+		_updateTime = millis();
+		_hasValue = true;
+	}
+
+	return true;
+}
+
+/**
+* @brief Offset of a curve at the outdoor temperature.
+*
+* @return int16_t Offset in tenths of °C.
+**/
+int16_t FanCoilWeatherClass::evaluate(const CurvePoint* curve, uint8_t curveLen, int32_t outdoor)
+{
+	if (outdoor <= curve[0].Outdoor)
+	{
+		return curve[0].Offset;
+	}
+
+	for (uint8_t i = 1; i < curveLen; i++)
+	{
+		if (outdoor <= curve[i].Outdoor)
+		{
+			const CurvePoint* from = &curve[i - 1];
+			const CurvePoint* to = &curve[i];
+
+			return from->Offset + (outdoor - from->Outdoor) * (to->Offset - from->Offset) / (to->Outdoor - from->Outdoor);
+		}
+	}
+
+	return curve[curveLen - 1].Offset;
+}
+
+bool FanCoilWeatherClass::isFresh()
+{
+	return _hasValue && millis() - _updateTime < WEATHER_STALE_MS;
+}
+
+/**
+* @brief The outdoor temperature.
+*
+* @return float °C, NAN - not received or stale.
+**/
+float FanCoilWeatherClass::outdoor()
+{
+	return isFresh() ? (float)_outdoor / POW10[WEATHER_PRECISION] : NAN;
+}
+
+/**
+* @brief Desired temperature offset for the current outdoor temperature.
+* @param mode Current mode.
+*
+* @return float Offset in °C, 0 if the outdoor temperature is not known.
+**/
+float FanCoilWeatherClass::offset(Mode mode)
+{
+	if (!isFresh())
+	{
+		return 0;
+	}
+
+	return (float)(mode == Heat ? _heatOffset : _coldOffset) / POW10[WEATHER_PRECISION];
+}
+
+FanCoilWeatherClass FanCoilWeather;
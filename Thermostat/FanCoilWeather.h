@@ -0,0 +1,72 @@
+// FanCoilWeather.h
+
+#ifndef _FANCOILWEATHER_h
+#define _FANCOILWEATHER_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+
+// Outdoor temperature older than this is not used, the offset is 0.
+#define WEATHER_STALE_MS 1800000
+// Outdoor temperature and offsets are in tenths of °C.
+#define WEATHER_PRECISION 1
+#define WEATHER_MIN_TEMPERATURE -600
+#define WEATHER_MAX_TEMPERATURE 700
+#define WEATHER_MIN_OFFSET -50
+#define WEATHER_MAX_OFFSET 50
+// Points of a curve from settings
+#define WEATHER_CURVE_MAX 6
+#define WEATHER_HEAT_CURVE_LEN 4
+#define WEATHER_COLD_CURVE_LEN 3
+
+/**
+* @brief Compensation curve point: desired temperature offset at an outdoor temperature, tenths of °C.
+*/
+struct CurvePoint
+{
+	int16_t Outdoor;
+	int16_t Offset;
+};
+
+// Default compensation curves, outdoor temperatures ascending. Between points the offset is linear, outside them it is the end offset.
+// Settings HeatCurve and ColdCurve replace them.
+// Heat: a warmer room when it is cold outside, walls and windows are colder.
+const CurvePoint WEATHER_HEAT_CURVE[WEATHER_HEAT_CURVE_LEN] = { { -200, 15 }, { -100, 10 }, { 0, 5 }, { 100, 0 } };
+// Cold: a warmer room when it is hot outside, the indoor and outdoor difference is limited.
+const CurvePoint WEATHER_COLD_CURVE[WEATHER_COLD_CURVE_LEN] = { { 250, 0 }, { 300, 5 }, { 350, 15 } };
+
+/**
+* @brief Weather compensation. The device subscribes to an outdoor temperature topic (settings OutdoorTopic) and shifts
+* the desired temperature by the curve offset. Curves are parsed from settings HeatCurve and ColdCurve once on start.
+* Offsets are calculated once per received value and kept, so the control reads them in O(1).
+**/
+class FanCoilWeatherClass
+{
+private:
+	const char* _topic;
+	CurvePoint _heatCurve[WEATHER_CURVE_MAX];
+	uint8_t _heatCurveLen;
+	CurvePoint _coldCurve[WEATHER_CURVE_MAX];
+	uint8_t _coldCurveLen;
+	int32_t _outdoor;
+	int16_t _heatOffset = 0;
+	int16_t _coldOffset = 0;
+	unsigned long _updateTime;
+	bool _hasValue = false;
+
+	uint8_t loadCurve(const char* text, const CurvePoint* defaultCurve, uint8_t defaultLen, CurvePoint* curve);
+	uint8_t parseCurve(const char* text, CurvePoint* curve);
+	int16_t evaluate(const CurvePoint* curve, uint8_t curveLen, int32_t outdoor);
+	bool isFresh();
+public:
+	void init(DeviceSettings* settings);
+
+	const char* topic();
+	bool processTopic(const char* topic, const byte* payload, unsigned int length);
+	float outdoor();
+	float offset(Mode mode);
+};
+
+extern FanCoilWeatherClass FanCoilWeather;
+
+#endif
@@ -0,0 +1,80 @@
+//
+//
+//
+
+#include "FanCoilWindow.h"
+
+/**
+* @brief Add a sample and check for an open window.
+* @param temperature Room temperature, NAN - the sensor does not exist.
+* @param humidity Room humidity, NAN - not known.
+* @param mode Current mode.
+*
+* @return bool true - the window state is changed.
+*/
+bool FanCoilWindowClass::process(float temperature, float humidity, Mode mode)
+{
+	unsigned long now = millis();
+	bool isChanged = false;
+
+	if (_isOpen && now - _openTime >= WINDOW_OPEN_SUSPEND_MS)
+	{
+		_isOpen = false;
+		_hasRef = false;
+		isChanged = true;
+	}
+
+	if (std::isnan(temperature))
+	{
+		_temperature = NAN;
+		_hasRef = false;
+		return isChanged;
+	}
+
+	_temperature = std::isnan(_temperature) ? temperature : _temperature + WINDOW_SMOOTH_WEIGHT * (temperature - _temperature);
+	_humidity = std::isnan(_humidity) ? humidity : _humidity + WINDOW_SMOOTH_WEIGHT * (humidity - _humidity);
+
+	if (!_hasRef)
+	{
+		_refTemperature = _temperature;
+		_refHumidity = _humidity;
+		_refTime = now;
+		_hasRef = true;
+
+		return isChanged;
+	}
+
+	if (now - _refTime < WINDOW_DETECT_MS)
+	{
+		return isChanged;
+	}
+
+	float hours = (now - _refTime) / 3600000.0;
+	float tempSlope = (_temperature - _refTemperature) / hours;
+	float humiditySlope = fabs(_humidity - _refHumidity) / hours;
+
+	_refTemperature = _temperature;
+	_refHumidity = _humidity;
+	_refTime = now;
+
+	// Heat is lost in Heat mode, cold is lost in Cold mode.
+	float loss = mode == Heat ? -tempSlope : tempSlope;
+
+	// NAN humidity slope does not pass the check.
+	if (!_isOpen
+		&& (loss >= WINDOW_OPEN_TEMP_SLOPE || (loss >= WINDOW_OPEN_TEMP_SLOPE / 2 && humiditySlope >= WINDOW_OPEN_HUMIDITY_SLOPE)))
+	{
+		_isOpen = true;
+		_openTime = now;
+		isChanged = true;
+	}
+
+	return isChanged;
+}
+
+bool FanCoilWindowClass::isOpen()
+{
+	return _isOpen;
+}
+
+FanCoilWindowClass FanCoilWindow;
@@ -0,0 +1,42 @@
+// FanCoilWindow.h
+
+#ifndef _FANCOILWINDOW_h
+#define _FANCOILWINDOW_h
+
+#include "Arduino.h"
+#include "FanCoilHelper.h"
+
+// Smoothing weight of a new temperature and humidity sample (EWMA)
+#define WINDOW_SMOOTH_WEIGHT 0.3
+// The trend is the smoothed value change over this time.
+#define WINDOW_DETECT_MS 120000
+// Temperature change against the mode (falling in Heat, rising in Cold) of an open window, °C per hour.
+#define WINDOW_OPEN_TEMP_SLOPE 12.0
+// Humidity change, %RH per hour. Together with it a half of the temperature change is enough.
+#define WINDOW_OPEN_HUMIDITY_SLOPE 30.0
+// The fan is stopped and the fan coil is bypassed for this time after an open window is detected.
+#define WINDOW_OPEN_SUSPEND_MS 900000
+
+/**
+* @brief Open window detector. A sharp room temperature change against the mode (and a humidity change)
+* means an open window. The state is a few values, it is updated on every temperature tick.
+**/
+class FanCoilWindowClass
+{
+private:
+	float _temperature = NAN;
+	float _humidity = NAN;
+	float _refTemperature;
+	float _refHumidity;
+	unsigned long _refTime;
+	bool _hasRef = false;
+	bool _isOpen = false;
+	unsigned long _openTime;
+public:
+	bool process(float temperature, float humidity, Mode mode);
+	bool isOpen();
+};
+
+extern FanCoilWindowClass FanCoilWindow;
+
+#endif
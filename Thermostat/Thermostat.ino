@@ -11,42 +11,94 @@
 // Last version date: 10.10.2017
 // Author: Plamen Kovandjiev <p.kovandiev@kmpelectronics.eu>
 
+#include "FanCoilBrokers.h"
 #include "FanCoilBypass.h"
 #include "FanCoilHelper.h"
+#include "FanCoilOta.h"
+#include "FanCoilPower.h"
+#include "FanCoilRemoteSensors.h"
+#include "FanCoilRuntime.h"
+#include "FanCoilSensors.h"
+#include "FanCoilWeather.h"
+#include "FanCoilWarmStart.h"
+#include "FanCoilWindow.h"
 #include <KMPDinoWiFiESP.h>       // Our library. https://www.kmpelectronics.eu/en-us/examples/prodinowifi-esp/howtoinstall.aspx
 #include <KMPCommon.h>
 
 #include <DNSServer.h>
 #include <ESP8266WebServer.h>
 #include <PubSubClient.h>         // Install with Library Manager. "PubSubClient by Nick O'Leary" https://pubsubclient.knolleary.net/
-#include <DHT.h>                  // Install with Library Manager. "DHT sensor library by Adafruit" https://github.com/adafruit/DHT-sensor-library
 #include <WiFiManager.h>          // Install with Library Manager. "WiFiManager by tzapu" https://github.com/tzapu/WiFiManager
 #include <DallasTemperature.h>    // Install with Library Manager. "DallasTemperature by Miles Burton, ..." https://github.com/milesburton/Arduino-Temperature-Control-Library
 #include <OneWire.h>			  // Install with Library Manager. "One Wire by Jim Studt, ..."
 
 DeviceSettings _settings;
 
+#ifdef MQTT_USE_TLS
+BearSSL::WiFiClientSecure _wifiClient;
+// Keeps the last TLS session. Reconnect resumes it and skips the full handshake.
+BearSSL::Session _tlsSession;
+bool _isTlsConfigured = false;
+#else
 WiFiClient _wifiClient;
+#endif
 PubSubClient _mqttClient;
-DHT _dhtSensor(DHT_SENSORS_PIN, DHT_SENSORS_TYPE, 11);
+ESP8266WebServer _webServer(HTTP_SERVER_PORT);
+// Temperature and humidity sensor selected in FanCoilHelper.h
+ClimateSensorDriver _climateSensor;
+// Climate and pipe sensor reads since start
+uint32_t _sensorReads = 0;
 
 OneWire _oneWire(ONEWIRE_SENSORS_PIN);
 DallasTemperature _oneWireSensors(&_oneWire);
 
 // Text buffers for topic and payload.
 char _topicBuff[128];
-char _payloadBuff[32];
+char _payloadBuff[48];
+
+// Prebuilt HTTP responses. They are rebuilt on a request only if published data was changed.
+char _statusBuff[STATUS_SNAPSHOT_LEN];
+char _metricsBuff[METRICS_SNAPSHOT_LEN];
+Snapshot _statusSnapshot = { _statusBuff, STATUS_SNAPSHOT_LEN, 0, UINT16_MAX };
+Snapshot _metricsSnapshot = { _metricsBuff, METRICS_SNAPSHOT_LEN, 0, UINT16_MAX };
 
 float _desiredTemperature = 22.0;
+// Humidity limit in Cold mode, 0 - off
+uint8_t _maxHumidity = 0;
+bool _isDehumidifying = false;
 
 uint8_t _fanDegree = 0;
 Mode _mode = Cold;
 DeviceState _deviceState = Off;
 DeviceState _lastDeviceState = Off;
 unsigned long _sendOkInterval;
+unsigned long _mqttReconnectTime = 0;
+
+// Building-wide broadcast topic. It is the base topic parent: flat/bedroom1 -> flat.
+char _broadcastTopic[BASE_TOPIC_LEN];
+unsigned long _broadcastResponseTime = 0;
+unsigned long _lastBroadcastTime = 0;
+bool _isBroadcastResponded = false;
+
+// Command rate limits per CommandClass. Set commands over the limit are coalesced, get requests are merged, pings are dropped.
+TokenBucket _commandLimits[CommandClassCount];
+DeviceCommand _pendingCommand;
+unsigned long _pendingCommandTime;
+uint16_t _pendingGetData = 0;
+
+// basetopic/availability: online (birth message), offline (last will)
+char _availabilityTopic[BASE_TOPIC_LEN + 16];
+// After (re)connect the device sends birth message and all data to refresh retained data.
+bool _isBirthPending = false;
 
 bool _isConnected = false;
 bool _isStarted = false;
+// The state is restored from RTC memory after a soft reset. Sensor windows and settings are not initialized again.
+bool _isWarmStart = false;
+// The state is changed after the last RTC snapshot
+bool _isWarmStateDirty = false;
+// Runtime counters are checkpointed and wait to be published
+bool _isRuntimePending = false;
 bool _isDHTExists = true;
 bool _isDS18b20Exists = true;
 
@@ -54,177 +106,362 @@ void publishData(DeviceData deviceData, bool sendCurrent = false)
 {
 	_sendOkInterval = millis() + OK_INTERVAL_MS;
 
+	// Every data change goes through here. Mark the HTTP snapshots to be rebuilt.
+	_statusSnapshot.Dirty |= deviceData;
+	_metricsSnapshot.Dirty |= deviceData;
+	_isWarmStateDirty = true;
+
 	if (!_isConnected || !_isStarted)
 	{
 		return;
 	}
 
-	if (CHECK_ENUM(deviceData, Temperature))
+	// Visit only set data bits
+	uint16_t fields = deviceData & ALL_DATA;
+	while (fields != 0)
 	{
-		strConcatenate(_topicBuff, 3, _settings.BaseTopic, TOPIC_SEPARATOR, TOPIC_TEMPERATURE);
+		const DataField* field = &DATA_FIELDS[__builtin_ctz(fields)];
+		fields &= fields - 1;
 
-		mqttPublish(_topicBuff, valueToStr(&TemperatureData, sendCurrent));
+		buildTopic(_topicBuff, _settings.BaseTopic, field->Topic);
+		const char* value = field->Format(_payloadBuff, sendCurrent ? FormatCurrent : FormatAverage);
+
+		mqttPublish(_topicBuff, value == NULL ? strcpy_P(_payloadBuff, NOT_AVILABLE) : (char*)value, MQTT_RETAIN_STATE);
 	}
 
-	if (CHECK_ENUM(deviceData, Humidity))
+	// Birth message. Last will message in the same topic is offline.
+	if (CHECK_ENUM(deviceData, DeviceIsReady))
 	{
-		strConcatenate(_topicBuff, 3, _settings.BaseTopic, TOPIC_SEPARATOR, TOPIC_HUMIDITY);
+		mqttPublish(_availabilityTopic, strcpy_P(_payloadBuff, PAYLOAD_ONLINE), true);
+	}
 
-		mqttPublish(_topicBuff, valueToStr(&HumidityData, sendCurrent));
+	if (CHECK_ENUM(deviceData, DeviceOk))
+	{
+		mqttPublish(_settings.BaseTopic, strcpy_P(_payloadBuff, PAYLOAD_OK));
 	}
+}
+
+/**
+* @brief Callback method. It is fire when has information in subscribed topics.
+*
+* @return void
+*/
+void callback(char* topic, byte* payload, unsigned int length) {
+	unsigned long receiveTime = micros();
+
+#ifdef WIFIFCMM_DEBUG
+	printTopicAndPayload("Call back", topic, (char*)payload, length);
+#endif
+
+	size_t baseTopicLen = strlen(_settings.BaseTopic);
 
-	if (CHECK_ENUM(deviceData, InletPipe))
+	// Processing broadcast topic - all devices respond with their data.
+	if (isEqual(topic, _broadcastTopic) && length == 0)
 	{
-		strConcatenate(_topicBuff, 3, _settings.BaseTopic, TOPIC_SEPARATOR, TOPIC_INLET_TEMPERATURE);
+		scheduleBroadcastResponse();
+		return;
+	}
 
-		mqttPublish(_topicBuff, valueToStr(&InletData, sendCurrent));
+	// Processing room temperature topics of other devices and the outdoor temperature.
+	if (FanCoilRemoteSensors.processTopic(topic, payload, length))
+	{
+		_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+		return;
 	}
 
-	if (CHECK_ENUM(deviceData, FanDegree))
+	if (FanCoilWeather.processTopic(topic, payload, length))
 	{
-		strConcatenate(_topicBuff, 3, _settings.BaseTopic, TOPIC_SEPARATOR, TOPIC_FAN_DEGREE);
-		IntToChars(_fanDegree, _payloadBuff);
+		_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+		return;
+	}
 
-		mqttPublish(_topicBuff, _payloadBuff);
+	if (!startsWith(topic, _settings.BaseTopic))
+	{
+		return;
 	}
 
-	if (CHECK_ENUM(deviceData, DesiredTemp))
+	// Processing base topic - command sends all data from the device.
+	if (strlen(topic) == baseTopicLen && length == 0)
 	{
-		strConcatenate(_topicBuff, 3, _settings.BaseTopic, TOPIC_SEPARATOR, TOPIC_DESIRED_TEMPERATURE);
-		FloatToChars(_desiredTemperature, TEMPERATURE_PRECISION, _payloadBuff);
+		requestData(ALL_DATA);
+		return;
+	}
+
+	// Remove prefix basetopic/
+	removeStart(topic, baseTopicLen + 1);
 
-		mqttPublish(_topicBuff, _payloadBuff);
+#ifdef OTA_MQTT
+	// Processing topics basetopic/ota/...
+	if (FanCoilOta.processTopic(topic, payload, length))
+	{
+		return;
 	}
+#endif
 
-	if (CHECK_ENUM(deviceData, CurrentMode))
+	// Processing topic basetopic/<data>/get: sends current data value
+	buildTopic(_topicBuff, "", TOPIC_GET);
+
+	if (endsWith(topic, _topicBuff))
 	{
-		strConcatenate(_topicBuff, 3, _settings.BaseTopic, TOPIC_SEPARATOR, TOPIC_MODE);
+		removeEnd(topic, strlen(_topicBuff));
+
+		// basetopic/status/get and basetopic/metrics/get: all data in one message.
+		bool isStatus = strcmp_P(topic, TOPIC_STATUS) == 0;
+		if (isStatus || strcmp_P(topic, TOPIC_METRICS) == 0)
+		{
+			if (takeToken(&_commandLimits[CommandGet], true))
+			{
+				dataWriter writer = isStatus ? writeStatus : writeMetrics;
+				buildTopic(_topicBuff, _settings.BaseTopic, isStatus ? TOPIC_STATUS : TOPIC_METRICS);
+				mqttPublishStream(_topicBuff, writer, false);
+			}
+			else
+			{
+				_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+			}
+
+			return;
+		}
 
-		const char * mode = _mode == Cold ? PAYLOAD_COLD : PAYLOAD_HEAT;
+		DeviceData data = getDataByTopic(topic);
+		if (data != 0)
+		{
+			requestData(data);
+		}
 
-		mqttPublish(_topicBuff, (char*)mode);
+		return;
 	}
 
-	if (CHECK_ENUM(deviceData, CurrentDeviceState))
+	// Processing topic basetopic/ping: <token>. Responds basetopic/pong: <token>;<receive time ms>;<send time ms>
+	if (strcmp_P(topic, TOPIC_PING) == 0)
 	{
-		strConcatenate(_topicBuff, 3, _settings.BaseTopic, TOPIC_SEPARATOR, TOPIC_DEVICE_STATE);
-
-		const char * mode = _deviceState == On ? PAYLOAD_ON : PAYLOAD_OFF;
+		if (takeToken(&_commandLimits[CommandPing], true))
+		{
+			publishPong((char*)payload, length);
+		}
+		else
+		{
+			_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+		}
 
-		mqttPublish(_topicBuff, (char*)mode);
+		return;
 	}
 
-	if (CHECK_ENUM(deviceData, BypassState))
+	// Processing topic basetopic/set: mode=heat;state=on;desiredtemp=22.5;id=42. All fields are applied together.
+	if (strcmp_P(topic, TOPIC_SET) == 0)
 	{
-		strConcatenate(_topicBuff, 3, _settings.BaseTopic, TOPIC_SEPARATOR, TOPIC_BYPASS_STATE);
+		DeviceCommand command;
+		bool isValid = parseCommand((char*)payload, length, &command, false) && command.Fields != 0;
+
+		executeCommand(&command, (DeviceData)command.Fields, isValid, receiveTime);
+		return;
+	}
 
-		const char * mode = FanCoilBypass.state() == On ? PAYLOAD_ON : PAYLOAD_OFF;
+	// All other topics finished with /set
+	buildTopic(_topicBuff, "", TOPIC_SET);
 
-		mqttPublish(_topicBuff, (char*)mode);
+	if (!endsWith(topic, _topicBuff))
+	{
+		return;
 	}
 
-	if (CHECK_ENUM(deviceData, DeviceIsReady))
+	// Remove /set
+	removeEnd(topic, strlen(_topicBuff));
+
+	// Processing topics:
+	//  basetopic/mode/set: heat/cold
+	//  basetopic/desiredtemp/set: 22.5
+	//  basetopic/state/set: on, off
+	DeviceData field = getDataByTopic(topic);
+	const DataField* dataField = getDataField(field);
+	if (dataField == NULL || dataField->Parse == NULL)
 	{
-		mqttPublish(_settings.BaseTopic, (char*)PAYLOAD_READY);
+		return;
 	}
 
-	if (CHECK_ENUM(deviceData, DeviceOk))
+	// Payload: <value> or <value>;id=42
+	const char* idPos = (const char*)memchr(payload, PAYLOAD_SEPARATOR, length);
+	size_t valueLen = idPos == NULL ? length : idPos - (char*)payload;
+
+	DeviceCommand command;
+	bool isValid = parseCommandValue(field, (char*)payload, valueLen, &command);
+
+	if (idPos != NULL)
 	{
-		mqttPublish(_settings.BaseTopic, (char*)PAYLOAD_OK);
+		// Only the correlation ID. Other fields are changed with basetopic/set.
+		isValid = parseCommand(idPos + 1, length - valueLen - 1, &command, true) && isValid;
 	}
+
+	executeCommand(&command, field, isValid, receiveTime);
 }
 
 /**
-* @brief Callback method. It is fire when has information in subscribed topics.
+* @brief Execute a set command if the rate limit allows it. Otherwise a valid command is merged into the pending one
+* (the latest value wins) and it is executed when the limit allows.
+* @param command The command.
+* @param requested Requested data. If the command is not valid, their current values are sent.
+* @param isValid Is the command valid.
+* @param receiveTime Time in us when the command was received.
 *
 * @return void
 */
-void callback(char* topic, byte* payload, unsigned int length) {
-#ifdef WIFIFCMM_DEBUG
-	printTopicAndPayload("Call back", topic, (char*)payload, length);
-#endif
-
-	size_t baseTopicLen = strlen(_settings.BaseTopic);
+void executeCommand(DeviceCommand* command, DeviceData requested, bool isValid, unsigned long receiveTime)
+{
+	// Only commands with allowed values are coalesced.
+	isValid = isValid && validateCommand(command);
 
-	if (!startsWith(topic, _settings.BaseTopic))
+	if (!takeToken(&_commandLimits[CommandSet], true))
 	{
+		_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+
+		if (isValid)
+		{
+			coalesceCommand(command, receiveTime);
+		}
+
 		return;
 	}
 
-	// Processing base topic - command sends all data from the device.
-	if (strlen(topic) == baseTopicLen && length == 0)
+	if (!isValid)
 	{
-		publishAllData();
+		// Not valid value. Send the current one.
+		publishData(requested);
+		publishAck(command, PAYLOAD_ERROR, receiveTime);
 		return;
 	}
 
-	// Remove prefix basetopic/
-	removeStart(topic, baseTopicLen + 1);
-
-	// All other topics finished with /set
-	strConcatenate(_topicBuff, 2, TOPIC_SEPARATOR, TOPIC_SET);
-
-	if (!endsWith(topic, _topicBuff))
+	// Older coalesced values are overwritten by the new ones.
+	if (_pendingCommand.Fields != 0)
 	{
-		return;
+		coalesceCommand(command, receiveTime);
+		command = &_pendingCommand;
+		receiveTime = _pendingCommandTime;
 	}
 
-	// Remove /set
-	removeEnd(topic, strlen(_topicBuff));
+	bool isApplied = applyCommand(command);
+	publishAck(command, isApplied ? PAYLOAD_OK : PAYLOAD_ERROR, receiveTime);
+
+	clearPendingCommand();
+}
 
-	// Processing topic basetopic/mode/set: heat/cold
-	if (isEqual(topic, TOPIC_MODE))
+/**
+* @brief Merge a command into the pending one. If both have a correlation ID, the pending command is acknowledged
+* now as coalesced and the merged command is acknowledged with the newer ID, so every command gets one ack.
+* @param command The newer command.
+* @param receiveTime Time in us when the newer command was received.
+*
+* @return void
+*/
+void coalesceCommand(DeviceCommand* command, unsigned long receiveTime)
+{
+	if (_pendingCommand.CorrelationId[0] != CH_NONE && command->CorrelationId[0] != CH_NONE)
 	{
-		setDeviceMode((char*)payload, length);
-		return;
+		publishAck(&_pendingCommand, PAYLOAD_COALESCED, _pendingCommandTime);
 	}
 
-	// Processing topic basetopic/desiredtemp/set: 22.5
-	if (isEqual(topic, TOPIC_DESIRED_TEMPERATURE))
+	// The processing time is measured for the acknowledged ID.
+	if (_pendingCommand.Fields == 0 || command->CorrelationId[0] != CH_NONE)
 	{
-		memcpy(_topicBuff, payload, length);
-		_topicBuff[length] = CH_NONE;
+		_pendingCommandTime = receiveTime;
+	}
 
-		float temp = atof(_topicBuff);
-		setDesiredTemperature(temp);
+	mergeCommand(&_pendingCommand, command);
+}
 
+/**
+* @brief Request data to be sent. Requests over the rate limit are merged and sent later.
+* @param data Requested data.
+*
+* @return void
+*/
+void requestData(DeviceData data)
+{
+	if (!takeToken(&_commandLimits[CommandGet], true))
+	{
+		_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+		_pendingGetData |= data;
 		return;
 	}
 
-	// Processing topic basetopic/state/set: on, off
-	if (isEqual(topic, TOPIC_DEVICE_STATE))
+	publishData((DeviceData)(data | _pendingGetData));
+	_pendingGetData = 0;
+}
+
+/**
+* @brief Execute coalesced commands and requests when the rate limit allows.
+*
+* @return void
+*/
+void processPendingCommands()
+{
+	if (_pendingCommand.Fields != 0 && takeToken(&_commandLimits[CommandSet], false))
 	{
-		bool isProcessed = false;
+		bool isApplied = applyCommand(&_pendingCommand);
+		publishAck(&_pendingCommand, isApplied ? PAYLOAD_OK : PAYLOAD_ERROR, _pendingCommandTime);
 
-		if (isEqual((char*)payload, PAYLOAD_ON, length))
-		{
-			if (setDeviceState(On))
-			{
-				_lastDeviceState = On;
-				isProcessed = true;
-			}
-		}
+		clearPendingCommand();
+	}
 
-		if (isEqual((char*)payload, PAYLOAD_OFF, length))
-		{
-			if (setDeviceState(Off))
-			{
-				_lastDeviceState = Off;
-				isProcessed = true;
-			}
-		}
+	if (_pendingGetData != 0 && takeToken(&_commandLimits[CommandGet], false))
+	{
+		publishData((DeviceData)_pendingGetData);
+		_pendingGetData = 0;
+	}
+}
 
-		if (isProcessed)
-		{
-			if (!isEqual(_settings.DeviceState, (char*)payload, length))
-			{
-				strncpy(_settings.DeviceState, (char*)payload, length);
-				SaveConfiguration(&_settings);
-			}
-		}
+void clearPendingCommand()
+{
+	_pendingCommand.Fields = 0;
+	_pendingCommand.CorrelationId[0] = CH_NONE;
+}
 
+/**
+* @brief Send a command acknowledgement basetopic/ack: <id>;<result>;<processing time us>. It is sent only if the command has a correlation ID.
+* @param command The command.
+* @param result ok or error.
+* @param receiveTime Time in us when the command was received.
+*
+* @return void
+*/
+void publishAck(DeviceCommand* command, PGM_P result, unsigned long receiveTime)
+{
+	if (command->CorrelationId[0] == CH_NONE || !_isConnected)
+	{
 		return;
 	}
+
+	unsigned long processingTime = micros() - receiveTime;
+
+	buildTopic(_topicBuff, _settings.BaseTopic, TOPIC_ACK);
+	size_t len = snprintf(_payloadBuff, sizeof(_payloadBuff), "%s;", command->CorrelationId);
+	strcpy_P(_payloadBuff + len, result);
+	len += strlen(_payloadBuff + len);
+	snprintf(_payloadBuff + len, sizeof(_payloadBuff) - len, ";%lu", processingTime);
+
+	mqttPublish(_topicBuff, _payloadBuff);
+}
+
+/**
+* @brief Respond to a ping with device timestamps basetopic/pong: <token>;<receive time ms>;<send time ms>.
+* @param payload The ping token.
+* @param length The token length.
+*
+* @return void
+*/
+void publishPong(char* payload, unsigned int length)
+{
+	unsigned long receiveTime = millis();
+
+	// Copy the token. Publishing overwrites the received payload.
+	char token[PING_TOKEN_LEN];
+	size_t tokenLen = length < PING_TOKEN_LEN ? length : PING_TOKEN_LEN - 1;
+	memcpy(token, payload, tokenLen);
+	token[tokenLen] = CH_NONE;
+
+	buildTopic(_topicBuff, _settings.BaseTopic, TOPIC_PONG);
+	snprintf(_payloadBuff, sizeof(_payloadBuff), "%s;%lu;%lu", token, receiveTime, millis());
+
+	mqttPublish(_topicBuff, _payloadBuff);
 }
 
 /**
@@ -240,10 +477,16 @@ void setup(void)
 	DEBUG_FC.begin(115200);
 	// Init KMP ProDino WiFi-ESP board.
 	KMPDinoWiFiESP.init();
-	KMPDinoWiFiESP.SetAllRelaysOff();
 	// Init bypass.
 	FanCoilBypass.init(&publishData);
 
+	// After a soft reset the fan and the bypass continue from the snapshot.
+	_isWarmStart = restoreWarmState();
+	if (!_isWarmStart)
+	{
+		KMPDinoWiFiESP.SetAllRelaysOff();
+	}
+
 	DEBUG_FC_PRINTLN(F("KMP fan coil management with Mqtt.\r\n"));
 
 	//WiFiManager
@@ -267,14 +510,39 @@ void setup(void)
 		return;
 	}
 	
+	// Runtime counters after power on. After a warm start they are newer in RTC memory.
+	if (!_isWarmStart)
+	{
+		FanCoilRuntime.load();
+	}
+
 	// Set WiFi mode to WIFI_STA - station
 	WiFi.mode(WIFI_STA);
+	FanCoilPower.init();
 
 	// Start sensors.
-	_dhtSensor.begin();
+	_climateSensor.begin();
 
 	// Initialize MQTT.
 	_mqttClient.setClient(_wifiClient);
+	_mqttClient.setBufferSize(MQTT_BUFFER_SIZE);
+	FanCoilBrokers.init(&_settings);
+	FanCoilRemoteSensors.init(&_settings);
+	FanCoilWeather.init(&_settings);
+	FanCoilOta.init(_settings.BaseTopic, mqttPublish);
+	getParentTopic(_settings.BaseTopic, _broadcastTopic);
+	buildTopic(_availabilityTopic, _settings.BaseTopic, TOPIC_AVAILABILITY);
+
+	initTokenBucket(&_commandLimits[CommandSet], SET_COMMANDS_BURST, SET_COMMAND_INTERVAL_MS);
+	initTokenBucket(&_commandLimits[CommandGet], GET_COMMANDS_BURST, GET_COMMAND_INTERVAL_MS);
+	initTokenBucket(&_commandLimits[CommandPing], PING_COMMANDS_BURST, PING_COMMAND_INTERVAL_MS);
+
+	// Start local HTTP status server.
+	_statusSnapshot.Writer = writeStatus;
+	_metricsSnapshot.Writer = writeMetrics;
+	_webServer.on(FPSTR(HTTP_STATUS_PATH), HTTP_GET, handleStatus);
+	_webServer.on(FPSTR(HTTP_METRICS_PATH), HTTP_GET, handleMetrics);
+	_webServer.begin();
 
 	// Switch off bypass. 
 	//FanCoilBypass.setBypassState(Off, true);
@@ -307,26 +575,51 @@ void loop(void)
 		_mqttClient.loop();
 	}
 
-	bool isDHTExists = getTemperatureAndHumidity();
-	processDHTStatus(isDHTExists);
+	// Local monitoring is served even if MQTT server is not available.
+	_webServer.handleClient();
 
-	bool isDS18B20Exists = getPipesTemperature();
-	processDS18B20Status(isDS18B20Exists);
+	// Sensors are read only when a channel needs a sample for its next tick.
+	if (isSampleDue(&TemperatureData) || isSampleDue(&HumidityData))
+	{
+		bool isDHTExists = getTemperatureAndHumidity();
+		processDHTStatus(isDHTExists);
+	}
 
-	if (!_isStarted)
+	if (isSampleDue(&InletData))
+	{
+		bool isDS18B20Exists = getPipesTemperature();
+		processDS18B20Status(isDS18B20Exists);
+	}
+
+	if (!_isStarted && !_isWarmStart)
 	{
 		setArrayValues(&TemperatureData);
 		setArrayValues(&HumidityData);
 		setArrayValues(&InletData);
 	}
 
-	processData(&TemperatureData);
+	if (processData(&TemperatureData))
+	{
+		processWindow();
+	}
+
 	processData(&HumidityData);
 	processData(&InletData);
 
 	uint8_t degree = processFanDegree();
 	setFanDegree(degree);
 
+	RuntimeEvent runtimeEvent = FanCoilRuntime.process(_fanDegree, FanCoilBypass.state() == On, _mode, getPipeDiffTemp());
+	if (runtimeEvent != RuntimeNone)
+	{
+		_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+	}
+
+	if (runtimeEvent == RuntimeCheckpoint)
+	{
+		_isRuntimePending = true;
+	}
+
 	// Not need at the moment
 	// if (millis() > _sendOkInterval)
 	// {
@@ -336,28 +629,147 @@ void loop(void)
 	if (!_isStarted)
 	{
 		_isStarted = true;
-		publishData(DeviceIsReady);
 
-		// Restore previous state
-		setDeviceMode(_settings.Mode, strlen(_settings.Mode));
+		// Restore previous state. After a warm start it is already restored.
+		if (!_isWarmStart)
+		{
+			DeviceCommand command;
+			for (uint8_t i = 0; i < DATA_FIELDS_LEN; i++)
+			{
+				if (DATA_FIELDS[i].Parse != NULL && DATA_FIELDS[i].SettingsKey != NULL)
+				{
+					const char* value = (char*)&_settings + DATA_FIELDS[i].SettingsOffset;
+					parseCommandValue((DeviceData)(1 << i), value, strlen(value), &command);
+				}
+			}
 
-		DeviceState deviceState = isEqual(_settings.DeviceState, PAYLOAD_ON) ? On : Off;
-		setDeviceState(deviceState);
+			applyCommand(&command);
+		}
+	}
 
-		float temp = atof(_settings.DesiredTemperature);
-		setDesiredTemperature(temp);
+	if (_isConnected && _isStarted && _isBirthPending)
+	{
+		_isBirthPending = false;
+		publishData((DeviceData)(DeviceIsReady | ALL_DATA));
 	}
 
 	FanCoilBypass.processByPassState();
+	FanCoilOta.process();
+
+	if (_isWarmStateDirty && _isStarted)
+	{
+		_isWarmStateDirty = false;
+		saveWarmState();
+	}
+
+	if (_isConnected)
+	{
+		processBroadcastResponse();
+		processPendingCommands();
+
+		if (_isRuntimePending)
+		{
+			_isRuntimePending = false;
+			buildTopic(_topicBuff, _settings.BaseTopic, TOPIC_RUNTIME);
+			mqttPublishStream(_topicBuff, writeRuntime, true);
+		}
+	}
+
+	if (FanCoilPower.idle(getIdleTime()))
+	{
+		_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+	}
+}
+
+/**
+* @brief Time until the next scheduled work: a sensor read or tick. There is no idle time while a firmware is updated.
+*
+* @return unsigned long Time in ms.
+*/
+unsigned long getIdleTime()
+{
+	if (FanCoilOta.isInProgress())
+	{
+		return 0;
+	}
+
+	return min(timeToSample(&TemperatureData), min(timeToSample(&HumidityData), timeToSample(&InletData)));
+}
+
+/**
+* @brief Save the control state and sensor windows to RTC memory.
+*
+* @return void
+*/
+void saveWarmState()
+{
+	WarmControl control = {};
+	control.DesiredTemperature = _desiredTemperature;
+	control.MaxHumidity = _maxHumidity;
+	control.FanDegree = _fanDegree;
+	control.Mode = _mode;
+	control.DeviceState = _deviceState;
+	control.LastDeviceState = _lastDeviceState;
+	control.BypassState = FanCoilBypass.state();
+	control.BypassTarget = FanCoilBypass.targetState();
+
+	FanCoilWarmStart.save(&control);
+}
+
+/**
+* @brief Restore the control state and sensor windows from RTC memory. Fan relays and the bypass keep their state.
+*
+* @return bool true - the state is restored.
+*/
+bool restoreWarmState()
+{
+	WarmControl control;
+	if (!FanCoilWarmStart.restore(&control))
+	{
+		return false;
+	}
+
+	_desiredTemperature = control.DesiredTemperature;
+	_maxHumidity = control.MaxHumidity;
+	_mode = (Mode)control.Mode;
+	_deviceState = (DeviceState)control.DeviceState;
+	_lastDeviceState = (DeviceState)control.LastDeviceState;
+
+	// Only the relay of the current degree is On. It is set again without switching Off.
+	for (uint8_t i = 0; i < FAN_SWITCH_LEVEL_LEN; i++)
+	{
+		KMPDinoWiFiESP.SetRelayState(i, i + 1 == control.FanDegree);
+	}
+	_fanDegree = control.FanDegree;
+
+	FanCoilBypass.restoreState((DeviceState)control.BypassState, (DeviceState)control.BypassTarget);
+
+	return true;
 }
 
 bool getTemperatureAndHumidity()
 {
-	bool result = _dhtSensor.read();
+	float temperature;
+	float humidity;
+
+	// One read gets both values, but every channel takes a sample only for its own tick.
+	bool isTemperatureDue = isSampleDue(&TemperatureData);
+	bool isHumidityDue = isSampleDue(&HumidityData);
+
+	_sensorReads++;
+	_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
+	bool result = _climateSensor.read(temperature, humidity);
 	if (result)
 	{
-		TemperatureData.Current = _dhtSensor.readTemperature();
-		HumidityData.Current = _dhtSensor.readHumidity();
+		if (isTemperatureDue)
+		{
+			addSample(&TemperatureData, temperature);
+		}
+
+		if (isHumidityDue)
+		{
+			addSample(&HumidityData, humidity);
+		}
 	}
 
 	TemperatureData.IsExists = result;
@@ -375,12 +787,14 @@ bool getPipesTemperature()
 
 	if (InletData.IsExists)
 	{
+		_sensorReads++;
+		_metricsSnapshot.Dirty |= SNAPSHOT_COUNTERS;
 		// Send the command to get temperatures.
 		_oneWireSensors.requestTemperatures();
 		float temp = _oneWireSensors.getTempC(InletData.Address);
 		if (temp != DEVICE_DISCONNECTED_C)
 		{
-			InletData.Current = _oneWireSensors.getTempC(InletData.Address);
+			addSample(&InletData, temp);
 		}
 		else
 		{
@@ -392,9 +806,20 @@ bool getPipesTemperature()
 }
 
 /**
-* @brief
+* @brief Set the device state and publish it.
+* @param state New state.
+*
+* @return bool true - the state is set. The device stays Off if it is not connected or DHT sensor does not exist.
 */
 bool setDeviceState(DeviceState state)
+{
+	bool result = updateDeviceState(state);
+	publishData(CurrentDeviceState);
+
+	return result;
+}
+
+bool updateDeviceState(DeviceState state)
 {
 	DeviceState shouldBe = state;
 
@@ -404,7 +829,6 @@ bool setDeviceState(DeviceState state)
 	}
 
 	_deviceState = shouldBe;
-	publishData(CurrentDeviceState);
 
 	return _deviceState == state;
 }
@@ -437,7 +861,7 @@ void processDHTStatus(bool isExists)
 
 	if (sendData)
 	{
-		publishData(DeviceData(Temperature | Humidity));
+		publishData(DeviceData(Temperature | Humidity | DewPoint));
 	}
 }
 
@@ -467,9 +891,15 @@ void processDS18B20Status(bool isExists)
 	}
 }
 
-void processData(SensorData* data)
+/**
+* @brief Collect the channel value and calculate its average on the channel tick.
+* @param data The channel.
+*
+* @return bool true - it was the channel tick.
+*/
+bool processData(SensorData* data)
 {
-	if (millis() > data->CheckInterval)
+	if (timeToDeadline(data->CheckInterval) < 0)
 	{
 		if (data->CurrentCollectPos >= data->DataCollectionLen)
 		{
@@ -491,15 +921,138 @@ void processData(SensorData* data)
 		}
 
 		// Set next time to read data.
-		data->CheckInterval = millis() + data->CheckDataIntervalMS;
+		updateSampleInterval(data);
+		data->CheckInterval = millis() + data->SampleIntervalMS;
+		resetSamples(data);
+
+		_isWarmStateDirty = true;
+
+		return true;
 	}
+
+	return false;
 }
 
-uint8_t processFanDegree()
-{
-	uint8_t degree = 0;
+/**
+* @brief Check the room for an open window on the temperature tick.
+*
+* @return void
+*/
+void processWindow()
+{
+	float temperature = TemperatureData.IsExists ? TemperatureData.Current : NAN;
+	float humidity = HumidityData.IsExists ? HumidityData.Current : NAN;
+
+	if (FanCoilWindow.process(temperature, humidity, _mode))
+	{
+		publishData(WindowOpen);
+	}
+}
+
+/**
+* @brief Distance from the room temperature to the nearest threshold of processFanDegree(): antifreeze when the device is Off
+* or a window is open, bypass and fan levels otherwise.
+* @param value Room temperature.
+*
+* @return float Distance in °C.
+*/
+float temperatureMargin(float value)
+{
+	if (_deviceState == Off || FanCoilWindow.isOpen())
+	{
+		return min(fabs(value - BYPASS_ON_MIN_ANTI_FREEZE_TEMPERTURE), fabs(value - BYPASS_OFF_MIN_ANTI_FREEZE_TEMPERTURE));
+	}
+
+	float room = FanCoilRemoteSensors.fuse(value);
+	float desired = getEffectiveDesiredTemperature();
+	float diffTemp = _mode == Cold ? room - desired : desired - room;
+
+	float margin = min(fabs(diffTemp - BYPASS_OFF_TEMPERTURE_DIFFERENCE), fabs(diffTemp - BYPASS_ON_TEMPERTURE_DIFFERENCE));
+	for (uint8_t i = 0; i < FAN_SWITCH_LEVEL_LEN; i++)
+	{
+		margin = min(margin, (float)fabs(diffTemp - FAN_SWITCH_LEVEL[i]));
+	}
+
+	return margin;
+}
 
+/**
+* @brief Distance from the inlet pipe temperature to the difference which allows the fan.
+* @param value Inlet pipe temperature.
+*
+* @return float Distance in °C, NAN if the device is Off.
+*/
+float inletMargin(float value)
+{
 	if (_deviceState == Off)
+	{
+		return NAN;
+	}
+
+	float pipeDiffTemp = _mode == Cold ? TemperatureData.Average - value : value - TemperatureData.Average;
+
+	return fabs(pipeDiffTemp - MIN_DIFFERENCE_TEMPERATURE);
+}
+
+/**
+* @brief Distance from the humidity to the dehumidifying thresholds.
+* @param value Humidity.
+*
+* @return float Distance in %RH, NAN if dehumidifying is off.
+*/
+float humidityMargin(float value)
+{
+	if (_mode != Cold || _maxHumidity == 0)
+	{
+		return NAN;
+	}
+
+	return min(fabs(value - _maxHumidity), fabs(value - (_maxHumidity - DEHUMIDIFY_HYSTERESIS)));
+}
+
+/**
+* @brief Room temperature: the local average fused with remote sensor topics.
+*
+* @return float Temperature in °C, NAN if there is no value.
+*/
+float getRoomTemperature()
+{
+	return FanCoilRemoteSensors.fuse(TemperatureData.IsExists ? TemperatureData.Average : NAN);
+}
+
+/**
+* @brief The desired temperature with the weather compensation offset, in the allowed desired temperature range.
+*
+* @return float Temperature in °C.
+*/
+float getEffectiveDesiredTemperature()
+{
+	float desired = _desiredTemperature + FanCoilWeather.offset(_mode);
+
+	return constrain(desired, MIN_DESIRED_TEMPERATURE, MAX_DESIRED_TEMPERATURE);
+}
+
+/**
+* @brief Inlet pipe and room temperature difference in the mode direction: positive if the fan coil heats in Heat mode or cools in Cold mode.
+*
+* @return float Difference in °C, NAN if the inlet sensor does not exist.
+*/
+float getPipeDiffTemp()
+{
+	if (!InletData.IsExists)
+	{
+		return NAN;
+	}
+
+	return _mode == Cold ? TemperatureData.Average - InletData.Average : InletData.Average - TemperatureData.Average;
+}
+
+uint8_t processFanDegree()
+{
+	uint8_t degree = 0;
+
+	// If a window is open the fan is stopped and the fan coil is bypassed as when Off. Only antifreeze works.
+	if (_deviceState == Off || FanCoilWindow.isOpen())
 	{
 		// Urgent antifreeze bypass action.
 		if (TemperatureData.Average < BYPASS_ON_MIN_ANTI_FREEZE_TEMPERTURE)
@@ -516,14 +1069,28 @@ uint8_t processFanDegree()
 		return degree;
 	}
 
-	float diffTemp = _mode == Cold ? TemperatureData.Average - _desiredTemperature /* Cold */ : _desiredTemperature - TemperatureData.Average /* Heat */;
+	// The desired temperature is compared with the room temperature (local and remote sensors).
+	// Antifreeze and the inlet pipe use the local sensor next to the fan coil.
+	// The desired temperature is shifted by the weather compensation.
+	float roomTemp = getRoomTemperature();
+	float desiredTemp = getEffectiveDesiredTemperature();
+	float diffTemp = _mode == Cold ? roomTemp - desiredTemp /* Cold */ : desiredTemp - roomTemp /* Heat */;
+
+	// Dehumidifying keeps the cold water in the fan coil, it condenses water from the air.
+	bool isDehumidifying = processDehumidify(diffTemp);
 
 	// Bypass the fan coil - Off.
-	if (diffTemp - BYPASS_OFF_TEMPERTURE_DIFFERENCE <= 0.0)
+	if (diffTemp - BYPASS_OFF_TEMPERTURE_DIFFERENCE <= 0.0 && !isDehumidifying)
 	{
 		FanCoilBypass.setBypassState(Off);
 	}
 
+	// Dehumidify - On.
+	if (isDehumidifying)
+	{
+		FanCoilBypass.setBypassState(On);
+	}
+
 	// Release bypass - On.
 	if (diffTemp - BYPASS_ON_TEMPERTURE_DIFFERENCE >= 0.0)
 	{
@@ -538,7 +1105,7 @@ uint8_t processFanDegree()
 	}
 
 	// If inlet sensor doesn't exist or difference between inlet pipe temperature and ambient temperature > 5 degree get fan degree.
-	if (!InletData.IsExists || pipeDiffTemp >= 5)
+	if (!InletData.IsExists || pipeDiffTemp >= MIN_DIFFERENCE_TEMPERATURE)
 	{
 		int i = FAN_SWITCH_LEVEL_LEN;
 		while (i > 0)
@@ -549,11 +1116,58 @@ uint8_t processFanDegree()
 				break;
 			}
 		}
+
+		if (isDehumidifying && degree < DEHUMIDIFY_FAN_DEGREE)
+		{
+			degree = DEHUMIDIFY_FAN_DEGREE;
+		}
 	}
 
 	return degree;
 }
 
+/**
+* @brief Humidity control in Cold mode with hysteresis. It starts above the humidity limit and stops
+* below the limit - DEHUMIDIFY_HYSTERESIS, or if the room is colder than desired by DEHUMIDIFY_MAX_OVERCOOL.
+* @param diffTemp Room and desired temperature difference in Cold mode.
+*
+* @return bool true - the fan coil should dehumidify.
+*/
+bool processDehumidify(float diffTemp)
+{
+	if (_mode != Cold || _maxHumidity == 0 || !HumidityData.IsExists)
+	{
+		_isDehumidifying = false;
+	}
+	else if (HumidityData.Average > _maxHumidity)
+	{
+		_isDehumidifying = true;
+	}
+	else if (HumidityData.Average < _maxHumidity - DEHUMIDIFY_HYSTERESIS)
+	{
+		_isDehumidifying = false;
+	}
+
+	return _isDehumidifying && diffTemp > -DEHUMIDIFY_MAX_OVERCOOL;
+}
+
+/**
+* @brief Dew point from temperature and humidity averages (Magnus formula).
+*
+* @return float Dew point in °C, NAN if a sensor does not exist.
+*/
+float getDewPoint()
+{
+	if (!TemperatureData.IsExists || !HumidityData.IsExists || HumidityData.Average <= 0)
+	{
+		return NAN;
+	}
+
+	float gamma = log(HumidityData.Average / 100.0) + 17.62 * TemperatureData.Average / (243.12 + TemperatureData.Average);
+
+	return 243.12 * gamma / (17.62 - gamma);
+}
+
 /**
 * @brief: Setting the degree of fun.
 * The degrees: 0 - stopped, 1 - low fan speed, 2 - medium, 3 - high
@@ -583,24 +1197,126 @@ void setFanDegree(uint8_t degree)
 	publishData(FanDegree);
 }
 
-void setDesiredTemperature(float temp)
+/**
+* @brief Check command values against the device limits. The desired temperature is rounded.
+* Received commands are checked before they are coalesced, so one wrong value does not cancel other pending fields.
+* @param command The command.
+*
+* @return bool true - all values are allowed.
+*/
+bool validateCommand(DeviceCommand* command)
 {
-	if (!std::isnan(temp))
+	if (CHECK_ENUM(command->Fields, DesiredTemp))
 	{
-		float roundTemp = roundF(temp, TEMPERATURE_PRECISION);
-		if (roundTemp >= MIN_DESIRED_TEMPERATURE && roundTemp <= MAX_DESIRED_TEMPERATURE)
+		float roundTemp = roundF(command->DesiredTemperature, TEMPERATURE_PRECISION);
+		if (std::isnan(roundTemp) || roundTemp < MIN_DESIRED_TEMPERATURE || roundTemp > MAX_DESIRED_TEMPERATURE)
 		{
-			_desiredTemperature = roundTemp;
+			return false;
+		}
 
-			FloatToChars(_desiredTemperature, TEMPERATURE_PRECISION, _payloadBuff);
-			if (!isEqual(_settings.DesiredTemperature, _payloadBuff))
-			{
-				strcpy(_settings.DesiredTemperature, _payloadBuff);
-				SaveConfiguration(&_settings);
-			}
+		command->DesiredTemperature = roundTemp;
+	}
+
+	return true;
+}
+
+/**
+* @brief Apply a command. All fields are checked before any change.
+* The configuration is saved once and all command fields are published together.
+* @param command Fields to change.
+*
+* @return bool true - the command is applied.
+*/
+bool applyCommand(DeviceCommand* command)
+{
+	if (!validateCommand(command))
+	{
+		// Not valid. Send the current values.
+		publishData((DeviceData)command->Fields);
+		return false;
+	}
+
+	// Applied fields are saved
+	uint16_t applied = command->Fields;
+
+	if (CHECK_ENUM(command->Fields, CurrentMode))
+	{
+		_mode = command->DeviceMode;
+	}
+
+	if (CHECK_ENUM(command->Fields, DesiredTemp))
+	{
+		_desiredTemperature = command->DesiredTemperature;
+	}
+
+	if (CHECK_ENUM(command->Fields, HumidityLimit))
+	{
+		_maxHumidity = command->MaxHumidity;
+	}
+
+	if (CHECK_ENUM(command->Fields, CurrentDeviceState))
+	{
+		if (updateDeviceState(command->State))
+		{
+			_lastDeviceState = command->State;
+		}
+		else
+		{
+			applied &= ~CurrentDeviceState;
+		}
+	}
+
+	if (saveFields((DeviceData)applied))
+	{
+		SaveConfiguration(&_settings);
+	}
+
+	// Thresholds are moved. Follow the room at the base rate until the trend is known again.
+	if (applied & (CurrentMode | DesiredTemp | CurrentDeviceState | HumidityLimit))
+	{
+		resetSampleInterval(&TemperatureData);
+		resetSampleInterval(&HumidityData);
+		resetSampleInterval(&InletData);
+	}
+
+	publishData((DeviceData)command->Fields);
+
+	return true;
+}
+
+/**
+* @brief Copy current values of saved fields into the settings.
+* @param fields Fields to save. Fields without a configuration key are skipped.
+*
+* @return bool true - some settings are changed and the configuration should be saved.
+*/
+bool saveFields(DeviceData fields)
+{
+	bool isChanged = false;
+
+	uint16_t saved = fields & ALL_DATA;
+	while (saved != 0)
+	{
+		const DataField* field = &DATA_FIELDS[__builtin_ctz(saved)];
+		saved &= saved - 1;
+
+		if (field->SettingsKey == NULL)
+		{
+			continue;
+		}
+
+		const char* value = field->Format(_payloadBuff, FormatAverage);
+		char* setting = (char*)&_settings + field->SettingsOffset;
+
+		if (!isEqual(setting, value))
+		{
+			strncpy(setting, value, field->SettingsLen - 1);
+			setting[field->SettingsLen - 1] = CH_NONE;
+			isChanged = true;
 		}
-		publishData(DesiredTemp);
 	}
+
+	return isChanged;
 }
 
 /**
@@ -611,11 +1327,61 @@ void setDesiredTemperature(float temp)
 * @return void
 */
 void mqttPublish(const char* topic, char* payload)
+{
+	mqttPublish(topic, payload, false);
+}
+
+/**
+* @brief Publish topic.
+* @param topic A topic title.
+* @param payload Data to send.
+* @param retained The server keeps the last message and sends it to new subscribers.
+*
+* @return void
+*/
+void mqttPublish(const char* topic, char* payload, bool retained)
 {
 #ifdef WIFIFCMM_DEBUG
 	printTopicAndPayload("Publish", topic, payload, strlen(payload));
 #endif
-	_mqttClient.publish(topic, (const char*)payload);
+	_mqttClient.publish(topic, (const char*)payload, retained);
+}
+
+/**
+* @brief Publish a payload generated by a writer. The payload is sent directly to the network on small parts,
+* so its size is not limited by the MQTT client buffer.
+* @param topic A topic title.
+* @param writer Generates the payload. It is called twice: to count the payload length and to send it.
+* @param retained The server keeps the last message and sends it to new subscribers.
+*
+* @return bool true - the payload is sent.
+*/
+bool mqttPublishStream(const char* topic, dataWriter writer, bool retained)
+{
+	unsigned long startTime = millis();
+
+	CountPrint counter;
+	writer(counter);
+
+	if (!_mqttClient.beginPublish(topic, counter.count(), retained))
+	{
+		return false;
+	}
+
+	ChunkPrint out(_mqttClient);
+	writer(out);
+	out.flush();
+
+	bool result = _mqttClient.endPublish();
+
+	DEBUG_FC_PRINT(F("Publish stream topic ["));
+	DEBUG_FC_PRINT(topic);
+	DEBUG_FC_PRINT(F("] bytes: "));
+	DEBUG_FC_PRINT(counter.count());
+	DEBUG_FC_PRINT(F(" for ms: "));
+	DEBUG_FC_PRINTLN(millis() - startTime);
+
+	return result;
 }
 
 /**
@@ -625,18 +1391,32 @@ void mqttPublish(const char* topic, char* payload)
 */
 bool connectMqtt()
 {
-	if (!_mqttClient.connected())
+	if (!_mqttClient.connected() && millis() > _mqttReconnectTime)
 	{
 		DEBUG_FC_PRINTLN(F("Trying to MQTT connect..."));
 
-		uint16_t port = atoi(_settings.MqttPort);
-		_mqttClient.setServer(_settings.MqttServer, port);
+		MqttBroker* broker = FanCoilBrokers.select();
+		if (broker == NULL)
+		{
+			DEBUG_FC_PRINTLN(F("Error: MQTT server is not set"));
+			_mqttReconnectTime = millis() + MQTT_RECONNECT_INTERVAL_MS;
+			return false;
+		}
+
+#ifdef MQTT_USE_TLS
+		if (!configureTls(broker))
+		{
+			_mqttReconnectTime = millis() + MQTT_RECONNECT_INTERVAL_MS;
+			return false;
+		}
+#endif
+		_mqttClient.setServer(broker->Host, broker->Port);
 		_mqttClient.setCallback(callback);
 
 		DEBUG_FC_PRINT(F("Server: \""));
-		DEBUG_FC_PRINT(_settings.MqttServer);
+		DEBUG_FC_PRINT(broker->Host);
 		DEBUG_FC_PRINT(F("\"\r\nPort:\""));
-		DEBUG_FC_PRINT(_settings.MqttPort);
+		DEBUG_FC_PRINT(broker->Port);
 		DEBUG_FC_PRINT(F("\"\r\nClientId:\""));
 		DEBUG_FC_PRINT(_settings.MqttClientId);
 		DEBUG_FC_PRINT(F("\"\r\nUser:\""));
@@ -645,8 +1425,25 @@ bool connectMqtt()
 		DEBUG_FC_PRINT(_settings.MqttPass);
 		DEBUG_FC_PRINTLN(F("\""));
 
-		if (_mqttClient.connect(_settings.MqttClientId, _settings.MqttUser, _settings.MqttPass))
+		unsigned long connectStart = millis();
+		uint32_t freeHeap = ESP.getFreeHeap();
+
+		// If the device disconnects unexpectedly, the server sends basetopic/availability: offline. It is retained.
+		// The client copies the will message, the payload buffer is free after connect.
+		strcpy_P(_payloadBuff, PAYLOAD_OFFLINE);
+		if (_mqttClient.connect(_settings.MqttClientId, _settings.MqttUser, _settings.MqttPass,
+			_availabilityTopic, MQTT_WILL_QOS, true, _payloadBuff))
 		{
+			_isBirthPending = true;
+
+			FanCoilBrokers.connected(millis() - connectStart);
+
+			DEBUG_FC_PRINT(F("MQTT connected for "));
+			DEBUG_FC_PRINT(millis() - connectStart);
+			DEBUG_FC_PRINT(F(" ms. Used heap: "));
+			DEBUG_FC_PRINT(freeHeap - ESP.getFreeHeap());
+			DEBUG_FC_PRINTLN(F(" bytes."));
+
 			DEBUG_FC_PRINTLN(F("MQTT connected. Subscribe for topics:"));
 			// Subscribe for topics:
 			//  basetopic
@@ -654,34 +1451,229 @@ bool connectMqtt()
 			DEBUG_FC_PRINTLN(_settings.BaseTopic);
 
 			//  basetopic/+/set. This pattern include:  basetopic/mode/set, basetopic/desiredtemp/set, basetopic/state/set
-			strConcatenate(_topicBuff, 5, _settings.BaseTopic, TOPIC_SEPARATOR, EVERY_ONE_LEVEL_TOPIC, TOPIC_SEPARATOR, TOPIC_SET);
+			appendTopic(buildTopic(_topicBuff, _settings.BaseTopic, EVERY_ONE_LEVEL_TOPIC), TOPIC_SET);
+			_mqttClient.subscribe(_topicBuff);
+			DEBUG_FC_PRINTLN(_topicBuff);
+
+			//  basetopic/set. Multi field command
+			buildTopic(_topicBuff, _settings.BaseTopic, TOPIC_SET);
+			_mqttClient.subscribe(_topicBuff);
+			DEBUG_FC_PRINTLN(_topicBuff);
+
+			//  basetopic/ping
+			buildTopic(_topicBuff, _settings.BaseTopic, TOPIC_PING);
+			_mqttClient.subscribe(_topicBuff);
+			DEBUG_FC_PRINTLN(_topicBuff);
+
+			//  basetopic/+/get. This pattern include all data topics: basetopic/temperature/get, basetopic/mode/get...
+			appendTopic(buildTopic(_topicBuff, _settings.BaseTopic, EVERY_ONE_LEVEL_TOPIC), TOPIC_GET);
 			_mqttClient.subscribe(_topicBuff);
 			DEBUG_FC_PRINTLN(_topicBuff);
+
+			//  broadcast topic: basetopic parent
+			if (strlen(_broadcastTopic) > 0)
+			{
+				_mqttClient.subscribe(_broadcastTopic);
+				DEBUG_FC_PRINTLN(_broadcastTopic);
+			}
+
+			//  room temperature topics of other devices
+			for (uint8_t i = 0; i < FanCoilRemoteSensors.count(); i++)
+			{
+				_mqttClient.subscribe(FanCoilRemoteSensors.topic(i));
+				DEBUG_FC_PRINTLN(FanCoilRemoteSensors.topic(i));
+			}
+
+			//  outdoor temperature topic
+			if (FanCoilWeather.topic() != NULL)
+			{
+				_mqttClient.subscribe(FanCoilWeather.topic());
+				DEBUG_FC_PRINTLN(FanCoilWeather.topic());
+			}
+
+#ifdef OTA_MQTT
+			//  basetopic/ota/#. Firmware update topics.
+			appendTopic(buildTopic(_topicBuff, _settings.BaseTopic, TOPIC_OTA), EVERY_MULTI_LEVEL_TOPIC);
+			_mqttClient.subscribe(_topicBuff);
+			DEBUG_FC_PRINTLN(_topicBuff);
+
+			// Continue an interrupted firmware update.
+			FanCoilOta.publishResume();
+#endif
 		}
 		else
 		{
 			DEBUG_FC_PRINT(F("failed, rc="));
-			DEBUG_FC_PRINT(_mqttClient.state());
-			DEBUG_FC_PRINTLN(F(" try again after 5 seconds"));
-			// Wait 5 seconds before retrying
-			delay(5000);
+			DEBUG_FC_PRINTLN(_mqttClient.state());
+
+			// Try other broker immediately.
+			if (FanCoilBrokers.failed())
+			{
+				return false;
+			}
+
+			DEBUG_FC_PRINTLN(F("Try again after 5 seconds"));
+			// Wait 5 seconds before retrying. Do not block the loop, sensors and HTTP server should work.
+			_mqttReconnectTime = millis() + MQTT_RECONNECT_INTERVAL_MS;
 		}
 	}
 
 	return _mqttClient.connected();
 }
 
-char* valueToStr(SensorData* sensorData, bool sendCurrent)
+#ifdef MQTT_USE_TLS
+/**
+* @brief Configure TLS client: pinned server certificate, session resumption and small buffers if the broker supports MFLN.
+* All brokers should use the same certificate.
+* @param broker MQTT broker to connect.
+*
+* @return bool true - TLS client is configured.
+*/
+bool configureTls(MqttBroker* broker)
+{
+	// Default BearSSL buffers are 16K + 512. Reduce them if the broker can send smaller records.
+	if (broker->Mfln < 0)
+	{
+		broker->Mfln = _wifiClient.probeMaxFragmentLength(broker->Host, broker->Port, MQTT_TLS_BUFFER_LEN) ? 1 : 0;
+		DEBUG_FC_PRINT(F("MQTT server supports MFLN: "));
+		DEBUG_FC_PRINTLN(broker->Mfln);
+	}
+
+	if (broker->Mfln == 1)
+	{
+		_wifiClient.setBufferSizes(MQTT_TLS_BUFFER_LEN, MQTT_TLS_BUFFER_LEN);
+	}
+	else
+	{
+		_wifiClient.setBufferSizes(16384, 512);
+	}
+
+	if (_isTlsConfigured)
+	{
+		return true;
+	}
+
+	if (strlen(_settings.MqttFingerprint) == 0)
+	{
+		DEBUG_FC_PRINTLN(F("Error: MQTT certificate fingerprint is not set"));
+		return false;
+	}
+
+	if (!_wifiClient.setFingerprint(_settings.MqttFingerprint))
+	{
+		DEBUG_FC_PRINTLN(F("Error: MQTT certificate fingerprint is not valid"));
+		return false;
+	}
+
+	_wifiClient.setSession(&_tlsSession);
+
+	_isTlsConfigured = true;
+
+	return true;
+}
+#endif
+
+/**
+* @brief Format a sensor value. Data field formatters of DATA_FIELDS are below.
+* @param sensorData The sensor.
+* @param buffer Result.
+* @param format Current or average value.
+*
+* @return const char* The value or NULL if the sensor does not exist.
+*/
+const char* formatSensor(SensorData* sensorData, char* buffer, FieldFormat format)
 {
 	if (!sensorData->IsExists)
 	{
-		return (char*)NOT_AVILABLE;
+		return NULL;
+	}
+
+	float val = format == FormatCurrent ? sensorData->Current : sensorData->Average;
+
+	floatToChars(val, sensorData->Precision, buffer);
+	return buffer;
+}
+
+const char* formatTemperature(char* buffer, FieldFormat format)
+{
+	return formatSensor(&TemperatureData, buffer, format);
+}
+
+const char* formatHumidity(char* buffer, FieldFormat format)
+{
+	return formatSensor(&HumidityData, buffer, format);
+}
+
+const char* formatInletTemperature(char* buffer, FieldFormat format)
+{
+	return formatSensor(&InletData, buffer, format);
+}
+
+const char* formatFanDegree(char* buffer, FieldFormat format)
+{
+	fixedToChars(_fanDegree, 0, buffer);
+	return buffer;
+}
+
+const char* formatDesiredTemperature(char* buffer, FieldFormat format)
+{
+	floatToChars(_desiredTemperature, TEMPERATURE_PRECISION, buffer);
+	return buffer;
+}
+
+const char* formatMode(char* buffer, FieldFormat format)
+{
+	if (format == FormatMetric)
+	{
+		fixedToChars(_mode, 0, buffer);
+		return buffer;
+	}
+
+	return strcpy_P(buffer, _mode == Cold ? PAYLOAD_COLD : PAYLOAD_HEAT);
+}
+
+const char* formatDeviceState(char* buffer, FieldFormat format)
+{
+	return formatOnOff(_deviceState, buffer, format);
+}
+
+const char* formatBypassState(char* buffer, FieldFormat format)
+{
+	return formatOnOff(FanCoilBypass.state(), buffer, format);
+}
+
+const char* formatWindowOpen(char* buffer, FieldFormat format)
+{
+	return formatOnOff(FanCoilWindow.isOpen() ? On : Off, buffer, format);
+}
+
+const char* formatHumidityLimit(char* buffer, FieldFormat format)
+{
+	fixedToChars(_maxHumidity, 0, buffer);
+	return buffer;
+}
+
+const char* formatDewPoint(char* buffer, FieldFormat format)
+{
+	float dewPoint = getDewPoint();
+	if (std::isnan(dewPoint))
+	{
+		return NULL;
 	}
 
-	float val = sendCurrent ? sensorData->Current : sensorData->Average;
+	floatToChars(dewPoint, TEMPERATURE_PRECISION, buffer);
+	return buffer;
+}
+
+const char* formatOnOff(DeviceState state, char* buffer, FieldFormat format)
+{
+	if (format == FormatMetric)
+	{
+		fixedToChars(state, 0, buffer);
+		return buffer;
+	}
 
-	FloatToChars(val, sensorData->Precision, _payloadBuff);
-	return _payloadBuff;
+	return strcpy_P(buffer, state == On ? PAYLOAD_ON : PAYLOAD_OFF);
 }
 
 void findPipeSensors()
@@ -704,37 +1696,199 @@ void findPipeSensors()
 	}
 }
 
-void publishAllData()
+/**
+* @brief Schedule a response to a broadcast. All devices respond to one broadcast, so the response is delayed
+* by a device specific time. Duplicated broadcasts are dropped.
+*
+* @return void
+*/
+void scheduleBroadcastResponse()
+{
+	if (_broadcastResponseTime != 0)
+	{
+		return;
+	}
+
+	if (_isBroadcastResponded && millis() - _lastBroadcastTime < BROADCAST_DEDUP_WINDOW_MS)
+	{
+		DEBUG_FC_PRINTLN(F("Duplicated broadcast is dropped"));
+		return;
+	}
+
+	_broadcastResponseTime = millis() + hashString(_settings.MqttClientId) % BROADCAST_JITTER_MS + 1;
+}
+
+/**
+* @brief Send a scheduled broadcast response: all device data in one message basetopic/status.
+*
+* @return void
+*/
+void processBroadcastResponse()
+{
+	if (_broadcastResponseTime == 0 || timeToDeadline(_broadcastResponseTime) > 0)
+	{
+		return;
+	}
+
+	_broadcastResponseTime = 0;
+	_lastBroadcastTime = millis();
+	_isBroadcastResponded = true;
+
+	buildSnapshot(&_statusSnapshot);
+
+	buildTopic(_topicBuff, _settings.BaseTopic, TOPIC_STATUS);
+	mqttPublish(_topicBuff, _statusSnapshot.Buffer);
+}
+
+/**
+* @brief Write all device data as JSON. Not existing sensors are null.
+* @param out Where to write.
+*
+* @return void
+*/
+void writeStatus(Print& out)
+{
+	out.print('{');
+
+	bool isFirst = true;
+
+	uint16_t fields = ALL_DATA;
+	while (fields != 0)
+	{
+		const DataField* field = &DATA_FIELDS[__builtin_ctz(fields)];
+		fields &= fields - 1;
+
+		if (!isFirst)
+		{
+			out.print(',');
+		}
+
+		isFirst = false;
+
+		const char* value = field->Format(_payloadBuff, FormatAverage);
+		writeJsonPair(out, field->Topic, value, value != NULL, field->IsString);
+	}
+
+	out.print('}');
+}
+
+void writeRuntime(Print& out)
 {
-	DeviceData deviceData = (DeviceData)
-		(Temperature | DesiredTemp | FanDegree | CurrentMode | CurrentDeviceState | Humidity | InletPipe | BypassState);
-	publishData(deviceData, false);
+	FanCoilRuntime.write(out);
 }
 
-void setDeviceMode(char* payload, unsigned int length)
+void writeJsonPair(Print& out, PGM_P name, const char* value, bool isExists, bool isString)
 {
-	bool isProcessed = false;
+	out.print('"');
+	out.print(FPSTR(name));
+	out.print(F("\":"));
 
-	if (isEqual(payload, PAYLOAD_HEAT, length))
+	if (!isExists)
 	{
-		_mode = Heat;
-		isProcessed = true;
+		out.print(F("null"));
+		return;
 	}
 
-	if (isEqual(payload, PAYLOAD_COLD, length))
+	if (isString)
 	{
-		_mode = Cold;
-		isProcessed = true;
+		out.print('"');
 	}
 
-	if (isProcessed)
+	out.print(value);
+
+	if (isString)
 	{
-		if (!isEqual(_settings.Mode, payload, length))
-		{
-			strncpy(_settings.Mode, payload, length);
-			SaveConfiguration(&_settings);
-		}
-		
-		publishData(CurrentMode);
+		out.print('"');
 	}
+}
+
+/**
+* @brief Write all device data in Prometheus text format. Not existing sensors are NaN.
+* Modes and states are numbers: heat - 0, cold - 1, off - 0, on - 1.
+* @param out Where to write.
+*
+* @return void
+*/
+void writeMetrics(Print& out)
+{
+	uint16_t fields = ALL_DATA;
+	while (fields != 0)
+	{
+		const DataField* field = &DATA_FIELDS[__builtin_ctz(fields)];
+		fields &= fields - 1;
+
+		const char* value = field->Format(_payloadBuff, FormatMetric);
+		writeMetric(out, field->Topic, value == NULL ? "NaN" : value);
+	}
+
+	fixedToChars(_commandLimits[CommandSet].Limited, 0, _payloadBuff);
+	writeMetric(out, METRIC_LIMITED_SET, _payloadBuff);
+	fixedToChars(_commandLimits[CommandGet].Limited, 0, _payloadBuff);
+	writeMetric(out, METRIC_LIMITED_GET, _payloadBuff);
+	fixedToChars(_commandLimits[CommandPing].Limited, 0, _payloadBuff);
+	writeMetric(out, METRIC_LIMITED_PING, _payloadBuff);
+
+	fixedToChars(_climateSensor.readDuration(), 0, _payloadBuff);
+	writeMetric(out, METRIC_SENSOR_READ, _payloadBuff);
+	fixedToChars(_sensorReads, 0, _payloadBuff);
+	writeMetric(out, METRIC_SENSOR_READS, _payloadBuff);
+
+	fixedToChars(FanCoilPower.energyPerHour(), 0, _payloadBuff);
+	writeMetric(out, METRIC_ENERGY, _payloadBuff);
+	fixedToChars(FanCoilPower.sleepPercent(), 0, _payloadBuff);
+	writeMetric(out, METRIC_SLEEP, _payloadBuff);
+
+	floatToChars(getRoomTemperature(), TEMPERATURE_PRECISION + 1, _payloadBuff);
+	writeMetric(out, METRIC_ROOM_TEMPERATURE, _payloadBuff);
+	floatToChars(FanCoilWeather.outdoor(), WEATHER_PRECISION, _payloadBuff);
+	writeMetric(out, METRIC_OUTDOOR_TEMPERATURE, _payloadBuff);
+	floatToChars(FanCoilWeather.offset(_mode), WEATHER_PRECISION, _payloadBuff);
+	writeMetric(out, METRIC_DESIRED_OFFSET, _payloadBuff);
+
+	const RuntimeCounters* runtime = FanCoilRuntime.counters();
+	fixedToChars(runtime->HeatWh, 0, _payloadBuff);
+	writeMetric(out, METRIC_HEAT, _payloadBuff);
+	fixedToChars(runtime->CoolWh, 0, _payloadBuff);
+	writeMetric(out, METRIC_COOL, _payloadBuff);
+	fixedToChars(runtime->BypassOnSeconds, 0, _payloadBuff);
+	writeMetric(out, METRIC_BYPASS_ON, _payloadBuff);
+}
+
+void writeMetric(Print& out, PGM_P name, const char* value)
+{
+	out.print(FPSTR(METRICS_PREFIX));
+	out.print(FPSTR(name));
+	out.print(' ');
+	out.println(value);
+}
+
+/**
+* @brief Send a prebuilt snapshot. The snapshot is rebuilt only if data was changed after the last request.
+*
+* @return void
+*/
+void sendSnapshot(Snapshot* snapshot, PGM_P contentType)
+{
+	buildSnapshot(snapshot);
+
+	// A cut response is not served. Increase the snapshot buffer length.
+	if (snapshot->IsOverflow)
+	{
+		_webServer.send(500);
+		return;
+	}
+
+	char type[CONTENT_TYPE_LEN];
+	strcpy_P(type, contentType);
+	_webServer.send(200, type, snapshot->Buffer, snapshot->Length);
+}
+
+void handleStatus()
+{
+	sendSnapshot(&_statusSnapshot, CONTENT_TYPE_JSON);
+}
+
+void handleMetrics()
+{
+	sendSnapshot(&_metricsSnapshot, CONTENT_TYPE_TEXT);
 }
\ No newline at end of file